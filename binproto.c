@@ -0,0 +1,295 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Binary event stream and commands. See binproto.h for the record layouts.
+ * Commands skip the text parser and go straight to x10cmd_exec().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include "global.h"
+#include "binproto.h"
+#include "encode.h"
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Render an event record. The caller owns the returned reference. */
+msgbuf_t *binproto_event(const x10event_t *ev)
+{
+    msgbuf_t *msg;
+    unsigned char *p;
+
+    msg = msgbuf_new(NULL, BIN_EVENT_SIZE);
+    if (msg == NULL) return NULL;
+    p = (unsigned char *)msg->data;
+    memset(p, 0, BIN_EVENT_SIZE);
+    put16(p, BIN_EVENT_SIZE);
+    p[2] = BIN_EVENT;
+    p[3] = ev->evclass | ((ev->dir == EV_TX) ? BIN_TX : 0);
+    put32(p + 4, ev->seq);
+    put64(p + 8, ev->monous);
+    put64(p + 16, ev->wallus);
+    put32(p + 24, ev->secaddr);
+    p[28] = ev->house;
+    p[29] = ev->unit;
+    p[30] = ev->func;
+    p[31] = ev->data;
+    p[32] = ev->data2;
+    p[33] = ev->flags;
+    p[34] = ev->rawlen;
+    memcpy(p + 35, ev->raw, ev->rawlen);
+    return msg;
+}
+
+/* Render a command state record. The caller owns the returned reference. */
+msgbuf_t *binproto_cmdstate(uint32_t cmdid, int state, uint64_t waitus,
+        uint64_t totalus)
+{
+    msgbuf_t *msg;
+    unsigned char *p;
+
+    msg = msgbuf_new(NULL, BIN_STATE_SIZE);
+    if (msg == NULL) return NULL;
+    p = (unsigned char *)msg->data;
+    put16(p, BIN_STATE_SIZE);
+    p[2] = BIN_STATE;
+    p[3] = state;
+    put32(p + 4, cmdid);
+    put32(p + 8, (waitus > 0xFFFFFFFFULL) ? 0xFFFFFFFFUL : waitus);
+    put32(p + 12, (totalus > 0xFFFFFFFFULL) ? 0xFFFFFFFFUL : totalus);
+    return msg;
+}
+
+/* Render a gap record. The caller owns the returned reference. */
+msgbuf_t *binproto_gap(uint32_t seq, uint32_t next)
+{
+    msgbuf_t *msg;
+    unsigned char *p;
+
+    msg = msgbuf_new(NULL, BIN_GAP_SIZE);
+    if (msg == NULL) return NULL;
+    p = (unsigned char *)msg->data;
+    put16(p, BIN_GAP_SIZE);
+    p[2] = BIN_GAP;
+    p[3] = 0;
+    put32(p + 4, seq);
+    put32(p + 8, next);
+    return msg;
+}
+
+/* Render a text record. The caller owns the returned reference. */
+msgbuf_t *binproto_text(const char *text, size_t len)
+{
+    msgbuf_t *msg;
+    unsigned char *p;
+
+    if (len > 0xFFFF - BIN_TEXT_SIZE) len = 0xFFFF - BIN_TEXT_SIZE;
+    msg = msgbuf_new(NULL, BIN_TEXT_SIZE + len);
+    if (msg == NULL) return NULL;
+    p = (unsigned char *)msg->data;
+    put16(p, BIN_TEXT_SIZE + len);
+    p[2] = BIN_TEXT;
+    p[3] = 0;
+    memcpy(p + BIN_TEXT_SIZE, text, len);
+    return msg;
+}
+
+/* Reply to a command, subscribe, or batch record. For BIN_OK, vals are
+ * the command ids, for BIN_EINVAL vals[0] is the index of the bad command,
+ * for BIN_EBUSY the estimated wait.
+ */
+static void binproto_reply(client_t *client, uint32_t tag, int status,
+        const uint32_t *vals, int nvals)
+{
+    unsigned char reply[BIN_REPLY_SIZE + (BATCH_MAX * 4)];
+    size_t len;
+    int i;
+
+    len = BIN_REPLY_SIZE + (nvals * 4);
+    put16(reply, len);
+    reply[2] = BIN_REPLY;
+    reply[3] = status;
+    put32(reply + 4, tag);
+    for (i = 0; i < nvals; i++)
+        put32(reply + BIN_REPLY_SIZE + (i * 4), vals[i]);
+    client_write(client, reply, len);
+}
+
+/* Convert a command record to x10cmd_t. Returns BIN_OK or error status. */
+static int binproto_cmd(const unsigned char *p, size_t reclen, x10cmd_t *cmd)
+{
+    if (reclen < BIN_CMD_SIZE) return BIN_EINVAL;
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->type = p[2];
+    cmd->rf8bitaddr = (p[3] & EVF_SEC8) ? 1 : 0;
+    cmd->house = p[8];
+    cmd->unit = (p[9]) ? p[9] - 1 : -1;
+    cmd->func = (p[10] == 0xFF) ? -1 : p[10];
+    cmd->len = p[11];
+    cmd->param[0] = p[12];
+    cmd->param[1] = p[13];
+    cmd->param[2] = p[14];
+    cmd->rfaddr = get32(p + 16);
+    if (cmd->len > sizeof(cmd->bytes)) return BIN_EINVAL;
+    memcpy(cmd->bytes, p + 20, cmd->len);
+    if (reclen >= (BIN_CMD_TTL + 4)) cmd->ttlms = get32(p + BIN_CMD_TTL);
+    if (x10cmd_check(cmd) < 0) return BIN_EINVAL;
+    return BIN_OK;
+}
+
+/* Set the client event filter from a subscribe record */
+static int binproto_subscribe(client_t *client, const unsigned char *p,
+        size_t reclen)
+{
+    char spec[CLIENT_INBUF];
+    evfilter_t filter;
+
+    memcpy(spec, p + 8, reclen - 8);
+    spec[reclen - 8] = '\0';
+    if (evfilter_parse(&filter, spec) < 0) return BIN_EINVAL;
+    client_subscribe(client, &filter);
+    return BIN_OK;
+}
+
+/* Queue size bytes of back to back command records as one unit. Fills in
+ * vals for binproto_reply(). Returns status.
+ */
+static int binproto_batch(int fd, const unsigned char *p, size_t size,
+        uint32_t *vals, int *nvals)
+{
+    x10cmd_t cmds[BATCH_MAX];
+    size_t off, len;
+    int n = 0, bad, eta;
+
+    for (off = 0; off < size; off += len) {
+        len = ((size - off) < 2) ? 0 : get16(p + off);
+        if ((len < BIN_CMD_SIZE) || (len > (size - off)) || (n >= BATCH_MAX)
+                || (binproto_cmd(p + off, len, &cmds[n]) != BIN_OK)) {
+            vals[0] = n;
+            *nvals = 1;
+            return BIN_EINVAL;
+        }
+        n++;
+    }
+    switch (x10cmd_batch(fd, cmds, n, vals, &bad, &eta)) {
+        case BATCH_OK:
+            *nvals = n;
+            return BIN_OK;
+        case BATCH_EINVAL:
+            vals[0] = bad;
+            *nvals = 1;
+            return BIN_EINVAL;
+        case BATCH_EBUSY:
+            vals[0] = eta;
+            *nvals = 1;
+            return BIN_EBUSY;
+        default:
+            *nvals = 0;
+            return BIN_EFAIL;
+    }
+}
+
+/* Run every complete command record in the client input buffer. Any partial
+ * record is left at the front of the buffer for the next read.
+ */
+void binproto_input(client_t *client)
+{
+    unsigned char *p = (unsigned char *)client->inbuf;
+    size_t left = client->inlen;
+    size_t reclen;
+    uint32_t tag;
+    uint32_t vals[BATCH_MAX];
+    int status, nvals;
+
+    while (left >= 2) {
+        reclen = get16(p);
+        if ((reclen < 8) || (reclen > sizeof(client->inbuf))) {
+            /* Lost record framing so there is no way to recover */
+            syslog(LOG_NOTICE, "binary client %d bad record length %lu",
+                    client->src.fd, (unsigned long)reclen);
+            del_client(client->src.fd);
+            return;
+        }
+        if (reclen > left) break;
+        /* Output queue full, keep this record and the rest for later */
+        if (client_hold(client, (p[2] != BIN_SUBSCRIBE) &&
+                    (p[2] != BIN_RESUME)))
+            break;
+        tag = get32(p + 4);
+        nvals = 0;
+        switch (p[2]) {
+            case BIN_SUBSCRIBE:
+                status = binproto_subscribe(client, p, reclen);
+                break;
+            case BIN_BATCH:
+                status = binproto_batch(client->src.fd, p + 8, reclen - 8,
+                        vals, &nvals);
+                break;
+            case BIN_RESUME:
+                status = (reclen < 12) ? BIN_EINVAL : BIN_OK;
+                break;
+            default:
+                /* A single command is a batch of one */
+                status = binproto_batch(client->src.fd, p, reclen,
+                        vals, &nvals);
+                break;
+        }
+        binproto_reply(client, tag, status, vals, nvals);
+        if (client->src.fd < 0) return;
+        /* After the reply so the gap record, if any, comes after it */
+        if ((p[2] == BIN_RESUME) && (status == BIN_OK)) {
+            client_resume(client, get32(p + 8));
+            if (client->src.fd < 0) return;
+        }
+        p += reclen;
+        left -= reclen;
+    }
+    if (left && (p != (unsigned char *)client->inbuf))
+        memmove(client->inbuf, p, left);
+    client->inlen = left;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include "client.h"
+#include "event.h"
+
+/* Binary event stream and commands on SERVER_PORT+3 (1102)
+ *
+ * Every record starts with its length in bytes, including the length field,
+ * so new fields can be added at the end. Readers must skip bytes past the
+ * fields they know. All multi-byte fields are big endian.
+ *
+ * Event record, server to client, BIN_EVENT_SIZE bytes
+ *   0  u16 record length
+ *   2  u8  BIN_EVENT
+ *   3  u8  event class (EV_PL..EV_RAW), BIN_TX bit set for transmit
+ *   4  u32 sequence number
+ *   8  u64 monotonic time in microseconds
+ *  16  u64 wall clock time in microseconds since 1970
+ *  24  u32 RF security address
+ *  28  u8  house code 0..15 for A..P, 0xFF if none
+ *  29  u8  unit code 1..16, 0 if none
+ *  30  u8  function FUNC_* for PL and RF, 0xFF if none.
+ *          RF security function or RF camera key code.
+ *  31  u8  data, dims or extended code data
+ *  32  u8  extended code command
+ *  33  u8  flags EVF_*
+ *  34  u8  number of raw bytes
+ *  35  u8  raw bytes[8]
+ *  43  u8  reserved
+ *
+ * Command record, client to server, at least BIN_CMD_SIZE bytes
+ *   0  u16 record length
+ *   2  u8  command X10CMD_PL, X10CMD_RF, X10CMD_RFSEC, X10CMD_RFCAM,
+ *          X10CMD_PT
+ *   3  u8  flags, EVF_SEC8 for an 8 bit RF security address
+ *   4  u32 tag, returned in the reply
+ *   8  u8  house code 0..15 for A..P
+ *   9  u8  unit code 1..16, 0 if none
+ *  10  u8  function FUNC_*, 0xFF for PL address only. RF security
+ *          function or RF camera key code.
+ *  11  u8  number of PT bytes
+ *  12  u8  params[3], dims or extended code command, subcommand, data
+ *  15  u8  reserved
+ *  16  u32 RF security address
+ *  20  u8  PT bytes[8]
+ *  28  u32 optional TTL in ms, 0 for none. The command is dropped if it
+ *          has not started by then.
+ *
+ * Subscribe record, client to server
+ *   0  u16 record length
+ *   2  u8  BIN_SUBSCRIBE
+ *   3  u8  reserved
+ *   4  u32 tag, returned in the reply
+ *   8  ASCII SUBSCRIBE arguments, same as the text command, to the end of
+ *      the record
+ *
+ * Batch record, client to server
+ *   0  u16 record length
+ *   2  u8  BIN_BATCH
+ *   3  u8  reserved
+ *   4  u32 tag, returned in the reply
+ *   8  up to BATCH_MAX command records back to back. Either all are queued
+ *      or none are.
+ *
+ * Resume record, client to server
+ *   0  u16 record length
+ *   2  u8  BIN_RESUME
+ *   3  u8  reserved
+ *   4  u32 tag, returned in the reply
+ *   8  u32 sequence number of the last event received. Events after it
+ *          that are still held are sent before live events.
+ *
+ * Gap record, server to client, BIN_GAP_SIZE bytes. Sent when events asked
+ * for by BIN_RESUME are no longer held.
+ *   0  u16 record length
+ *   2  u8  BIN_GAP
+ *   3  u8  reserved
+ *   4  u32 sequence number from BIN_RESUME
+ *   8  u32 sequence number of the next event sent. Events in between are
+ *          lost.
+ *
+ * Command state record, server to client, BIN_STATE_SIZE bytes
+ *   0  u16 record length
+ *   2  u8  BIN_STATE
+ *   3  u8  CMD_QUEUED, CMD_SENT, CMD_ACKED, CMD_TIMEOUT, CMD_COALESCED,
+ *          CMD_EXPIRED, CMD_CANCELLED, or CMD_DROPPED
+ *   4  u32 command id from the reply
+ *   8  u32 microseconds from queued to the first frame sent. For
+ *          CMD_QUEUED, the estimated wait.
+ *  12  u32 microseconds from queued to this state
+ *
+ * Text record, server to client, at least BIN_TEXT_SIZE bytes. Status and
+ * error messages that have no record of their own, the same line a text
+ * client gets.
+ *   0  u16 record length
+ *   2  u8  BIN_TEXT
+ *   3  u8  reserved
+ *   4  ASCII text to the end of the record
+ *
+ * Reply record, server to client, BIN_REPLY_SIZE bytes plus 4 per value
+ *   0  u16 record length
+ *   2  u8  BIN_REPLY
+ *   3  u8  status BIN_OK, BIN_EINVAL, ...
+ *   4  u32 tag from the command
+ *   8  u32 values. For BIN_OK, the id of each command queued. For
+ *      BIN_EINVAL from a command or batch, the index of the first bad
+ *      command. For BIN_EBUSY, the estimated wait in ms.
+ */
+
+/* Record types */
+#define BIN_EVENT       (1)
+#define BIN_REPLY       (2)
+#define BIN_STATE       (3)
+#define BIN_GAP         (4)
+#define BIN_TEXT        (5)
+
+#define BIN_TX          (0x80)
+
+/* Command record types other than X10CMD_* */
+#define BIN_SUBSCRIBE   (0x80)
+#define BIN_BATCH       (0x81)
+#define BIN_RESUME      (0x82)
+
+#define BIN_EVENT_SIZE  (44)
+#define BIN_CMD_SIZE    (28)
+#define BIN_CMD_TTL     (28)    /* Offset of the optional TTL */
+#define BIN_REPLY_SIZE  (8)
+#define BIN_STATE_SIZE  (16)
+#define BIN_GAP_SIZE    (12)
+#define BIN_TEXT_SIZE   (4)
+
+/* Reply status */
+#define BIN_OK          (0)
+#define BIN_EINVAL      (1)     /* Malformed or invalid command */
+#define BIN_EFAIL       (2)     /* No room to queue the commands */
+#define BIN_EBUSY       (3)     /* Estimated wait over --max-latency */
+
+msgbuf_t *binproto_event(const x10event_t *ev);
+
+msgbuf_t *binproto_cmdstate(uint32_t cmdid, int state, uint64_t waitus,
+        uint64_t totalus);
+
+msgbuf_t *binproto_gap(uint32_t seq, uint32_t next);
+
+msgbuf_t *binproto_text(const char *text, size_t len);
+
+void binproto_input(client_t *client);
+
+#endif
@@ -0,0 +1,998 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Socket clients
+ * Clients are kept in a table indexed by file descriptor so lookup, add, and
+ * delete do not depend on the number of connected clients. Clients of each
+ * type are also kept on a doubly linked list so broadcasts only walk the
+ * clients that want them.
+ */
+
+#define _GNU_SOURCE             /* accept4() */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "global.h"
+#include "client.h"
+#include "encode.h"
+#include "binproto.h"
+#include "decode.h"
+#include "x10_write.h"
+#include "replay.h"
+#include "http.h"
+
+typedef struct listener {
+    pollsrc_t src;                  /* Must be first */
+    clienttype_t type;
+    unsigned int opts;              /* Given to each accepted client */
+    uint64_t pauseduntil;           /* Accept paused until, 0 if not */
+} listener_t;
+
+/* Out of fds or memory, wait this long before accept() again unless a
+ * client goes away first. Log it at most once per LISTEN_LOG_US.
+ */
+#define LISTEN_BACKOFF_US   (1000000)
+#define LISTEN_LOG_US       (60000000)
+
+static listener_t Listeners[CLIENT_NTYPES];
+static uint64_t Listenlogus;
+
+/* Indexed by fd, grows as needed */
+static client_t **Clienttab = NULL;
+static size_t Clienttabsize = 0;
+
+static client_t *Clientlist[CLIENT_NTYPES];
+static size_t NClients[CLIENT_NTYPES];
+
+/* Last client serial number given out */
+static uint32_t Clientserial = 0;
+
+/* Number of clients subscribed to EV_RAW */
+static int NRaw = 0;
+
+/* Number of clients with input held by client_hold() */
+static int NHeld = 0;
+
+/* Deleted clients are freed after the current epoll batch is done */
+static client_t *Zombies = NULL;
+
+static const char *Clienttypename[CLIENT_NTYPES] = {
+    "plain",
+    "xml",
+    "or20",
+    "binary",
+    "http",
+    "amqp",
+};
+
+size_t ClientMaxQueue = 64*1024;
+slowpolicy_t ClientSlowPolicy = SLOW_DROP;
+
+#define OUTQ_MINSIZE    (16)    /* Initial output queue slots */
+#define OUTQ_IOVMAX     (64)    /* Messages per sendmsg() */
+#define HOLD_FRAMES     (2)     /* Most frames one command queues */
+
+static int clienttab_grow(int fd)
+{
+    size_t newsize;
+    client_t **newtab;
+
+    newsize = (Clienttabsize) ? Clienttabsize : 64;
+    while (newsize <= (size_t)fd)
+        newsize *= 2;
+    newtab = realloc(Clienttab, newsize * sizeof(Clienttab[0]));
+    if (newtab == NULL) {
+        dbprintf("clienttab_grow(%d) no memory\n", fd);
+        return -1;
+    }
+    memset(newtab + Clienttabsize, 0,
+            (newsize - Clienttabsize) * sizeof(Clienttab[0]));
+    Clienttab = newtab;
+    Clienttabsize = newsize;
+    return 0;
+}
+
+client_t *client_find(int fd)
+{
+    if ((fd < 0) || ((size_t)fd >= Clienttabsize)) return NULL;
+    return Clienttab[fd];
+}
+
+client_t *client_first(clienttype_t type)
+{
+    return Clientlist[type];
+}
+
+static void client_handler(pollsrc_t *src, uint32_t events);
+
+/* Add new socket client */
+static client_t *add_client(int fd, clienttype_t type, unsigned int opts)
+{
+    client_t *client;
+
+    dbprintf("add_client(%d,%s)\n", fd, Clienttypename[type]);
+    if (((size_t)fd >= Clienttabsize) && (clienttab_grow(fd) < 0))
+        return NULL;
+
+    client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        dbprintf("add_client no memory\n");
+        return NULL;
+    }
+    client->src.fd = fd;
+    client->src.handler = client_handler;
+    client->type = type;
+    switch (type) {
+        case CLIENT_XML:
+            client->framing = FRAME_XML;
+            break;
+        case CLIENT_BINARY:
+            client->framing = FRAME_BINARY;
+            break;
+        case CLIENT_HTTP:
+            client->framing = FRAME_SSE;
+            break;
+        default:
+            client->framing = FRAME_PLAIN;
+            break;
+    }
+    client->opts = opts;
+    client->serial = ++Clientserial;
+    /* Raw frames only if --raw-data, else use SUBSCRIBE RAW */
+    evfilter_all(&client->filter);
+    if (!raw_data) client->filter.classes &= ~(1U << EV_RAW);
+    /* No events until GET /events */
+    if (type == CLIENT_HTTP) memset(&client->filter, 0, sizeof(client->filter));
+    if (client->filter.classes & (1U << EV_RAW)) NRaw++;
+    client->events = EPOLLIN;
+    if (reactor_add(&client->src, client->events) < 0) {
+        free(client);
+        return NULL;
+    }
+
+    Clienttab[fd] = client;
+    client->prev = NULL;
+    client->next = Clientlist[type];
+    if (client->next) client->next->prev = client;
+    Clientlist[type] = client;
+    NClients[type]++;
+    dbprintf("add_client: %s NClients %lu\n", Clienttypename[type],
+            (unsigned long)NClients[type]);
+    return client;
+}
+
+/* Delete socket client. The socket is closed. */
+int del_client(int fd)
+{
+    client_t *client;
+
+    dbprintf("del_client(%d)\n", fd);
+    client = client_find(fd);
+    if (client == NULL) {
+        dbprintf("del_client:fd not found %d\n", fd);
+        return -1;
+    }
+
+    reactor_del(&client->src);
+    Clienttab[fd] = NULL;
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        Clientlist[client->type] = client->next;
+    if (client->next) client->next->prev = client->prev;
+    NClients[client->type]--;
+    if (client->filter.classes & (1U << EV_RAW)) NRaw--;
+    dbprintf("del_client: %s NClients %lu\n", Clienttypename[client->type],
+            (unsigned long)NClients[client->type]);
+    if (client->dropped)
+        syslog(LOG_NOTICE, "%s client %d dropped %lu messages",
+                Clienttypename[client->type], fd, client->dropped);
+
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    client->src.fd = -1;
+    client->prev = NULL;
+    client->next = Zombies;
+    Zombies = client;
+    return 0;
+}
+
+/* Accept again on paused listen sockets once the back off is over, or
+ * right away if freed says a client closed its fd.
+ */
+static void listen_resume(int freed)
+{
+    listener_t *listener;
+    uint64_t now = 0;
+    clienttype_t type;
+
+    for (type = 0; type < CLIENT_NTYPES; type++) {
+        listener = &Listeners[type];
+        if (listener->pauseduntil == 0) continue;
+        if (!freed) {
+            if (now == 0) now = monotonic_us();
+            if (now < listener->pauseduntil) continue;
+        }
+        listener->pauseduntil = 0;
+        reactor_mod(&listener->src, EPOLLIN);
+    }
+}
+
+/* Shorten timeout (milliseconds, -1 = forever) so the main loop wakes up
+ * when a paused listen socket is due to accept again.
+ */
+int client_poll_timeout(int timeout)
+{
+    uint64_t now = 0;
+    clienttype_t type;
+    int ms;
+
+    for (type = 0; type < CLIENT_NTYPES; type++) {
+        if (Listeners[type].pauseduntil == 0) continue;
+        if (now == 0) now = monotonic_us();
+        if (now >= Listeners[type].pauseduntil) return 0;
+        ms = (int)((Listeners[type].pauseduntil - now + 999) / 1000);
+        if ((timeout < 0) || (ms < timeout)) timeout = ms;
+    }
+    return timeout;
+}
+
+void client_reap(void)
+{
+    client_t *client;
+    int freed = 0;
+
+    while ((client = Zombies) != NULL) {
+        freed++;
+        Zombies = client->next;
+        while (client->outqcount) {
+            msgbuf_unref(client->outq[client->outqhead]);
+            client->outqhead = (client->outqhead + 1) & (client->outqsize - 1);
+            client->outqcount--;
+        }
+        free(client->outq);
+        free(client->batch);
+        free(client);
+    }
+    listen_resume(freed);
+}
+
+void client_closeall(void)
+{
+    clienttype_t type;
+    int i;
+
+    for (type = 0; type < CLIENT_NTYPES; type++) {
+        while (Clientlist[type])
+            del_client(Clientlist[type]->src.fd);
+        if (Listeners[type].src.handler) {
+            reactor_del(&Listeners[type].src);
+            close(Listeners[type].src.fd);
+            Listeners[type].src.fd = -1;
+            Listeners[type].src.handler = NULL;
+        }
+    }
+    client_reap();
+    for (i = 0; i < CLIENT_NTYPES; i++) NClients[i] = 0;
+    free(Clienttab);
+    Clienttab = NULL;
+    Clienttabsize = 0;
+}
+
+/* Ask the reactor for EPOLLOUT only while there is something queued, and
+ * for EPOLLIN unless input is held
+ */
+static void client_want_write(client_t *client, int on)
+{
+    uint32_t events;
+
+    events = (on) ? EPOLLOUT : 0;
+    if (!client->held) events |= EPOLLIN;
+    if (events == client->events) return;
+    client->events = events;
+    reactor_mod(&client->src, events);
+}
+
+msgbuf_t *msgbuf_new(const void *data, size_t len)
+{
+    msgbuf_t *msg;
+
+    msg = malloc(sizeof(*msg) + len + 1);
+    if (msg == NULL) {
+        dbprintf("msgbuf_new(%lu) no memory\n", (unsigned long)len);
+        return NULL;
+    }
+    msg->refs = 1;
+    msg->len = len;
+    if (data) memcpy(msg->data, data, len);
+    msg->data[len] = '\0';
+    return msg;
+}
+
+msgbuf_t *msgbuf_ref(msgbuf_t *msg)
+{
+    msg->refs++;
+    return msg;
+}
+
+void msgbuf_unref(msgbuf_t *msg)
+{
+    if (msg && (--msg->refs == 0)) free(msg);
+}
+
+/* Return the message in the requested framing, rendering it the first time
+ * it is needed. The bcast keeps the reference.
+ */
+msgbuf_t *bcast_frame(bcast_t *bcast, framing_t framing)
+{
+    msgbuf_t *plain = bcast->frame[FRAME_PLAIN];
+    msgbuf_t *msg;
+
+    if (bcast->frame[framing]) return bcast->frame[framing];
+    if ((plain == NULL) && (framing != FRAME_BINARY)) return NULL;
+    switch (framing) {
+        case FRAME_XML:
+            /* Replace trailing newline with NUL if present. Flash XMLSocket
+             * messages are terminated by NUL which is sent.
+             */
+            msg = msgbuf_new(plain->data, plain->len);
+            if (msg && msg->len && (msg->data[msg->len-1] == '\n'))
+                msg->data[msg->len-1] = '\0';
+            break;
+        case FRAME_BINARY:
+            if (bcast->ev)
+                msg = binproto_event(bcast->ev);
+            else
+                msg = (plain) ? binproto_text(plain->data, plain->len) : NULL;
+            break;
+        case FRAME_SEQ:
+            /* Only events are numbered */
+            if (bcast->ev) {
+                char seq[16];
+                int len;
+
+                len = snprintf(seq, sizeof(seq), "[%u] ", bcast->ev->seq);
+                msg = msgbuf_new(NULL, len + plain->len);
+                if (msg) {
+                    memcpy(msg->data, seq, len);
+                    memcpy(msg->data + len, plain->data, plain->len);
+                }
+            }
+            else
+                msg = msgbuf_ref(plain);
+            break;
+        case FRAME_SSE:
+            msg = (bcast->ev) ? http_sse_event(bcast->ev, plain) : NULL;
+            break;
+        default:
+            msg = NULL;
+            break;
+    }
+    bcast->frame[framing] = msg;
+    return msg;
+}
+
+void bcast_release(bcast_t *bcast)
+{
+    int i;
+
+    for (i = 0; i < FRAME_NTYPES; i++) {
+        msgbuf_unref(bcast->frame[i]);
+        bcast->frame[i] = NULL;
+    }
+}
+
+static int client_replay(client_t *client);
+
+/* Send as much of the output queue as the socket will take without
+ * blocking. Returns -1 if the client was deleted.
+ */
+static int client_flush(client_t *client)
+{
+    struct iovec iov[OUTQ_IOVMAX];
+    struct msghdr msg;
+    msgbuf_t *head;
+    size_t i, n, slot, sent;
+    ssize_t bytesOut;
+
+    while (client->outqcount) {
+        n = client->outqcount;
+        if (n > OUTQ_IOVMAX) n = OUTQ_IOVMAX;
+        for (i = 0; i < n; i++) {
+            slot = (client->outqhead + i) & (client->outqsize - 1);
+            iov[i].iov_base = client->outq[slot]->data;
+            iov[i].iov_len = client->outq[slot]->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + client->outqoff;
+        iov[0].iov_len -= client->outqoff;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        /* writev() that does not raise SIGPIPE */
+        bytesOut = sendmsg(client->src.fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+        if (bytesOut < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+            dbprintf("%s: %d -1/%d\n", __func__, client->src.fd, errno);
+            del_client(client->src.fd);
+            return -1;
+        }
+        client->outqbytes -= bytesOut;
+        sent = bytesOut;
+        while (sent) {
+            head = client->outq[client->outqhead];
+            if (sent < (head->len - client->outqoff)) {
+                client->outqoff += sent;
+                break;
+            }
+            sent -= head->len - client->outqoff;
+            msgbuf_unref(head);
+            client->outq[client->outqhead] = NULL;
+            client->outqhead = (client->outqhead + 1) & (client->outqsize - 1);
+            client->outqcount--;
+            client->outqoff = 0;
+        }
+    }
+    if (client->replaynext && (client_replay(client) < 0)) return -1;
+    if (client->throttled && (client->outqbytes < (ClientMaxQueue / 2))) {
+        client->throttled = 0;
+        syslog(LOG_NOTICE, "%s client %d caught up, %lu messages dropped",
+                Clienttypename[client->type], client->src.fd, client->dropped);
+    }
+    if (client->closing && (client->outqcount == 0)) {
+        del_client(client->src.fd);
+        return -1;
+    }
+    client_want_write(client, client->outqcount != 0);
+    return 0;
+}
+
+/* Close the client once everything queued for it has been sent. Input
+ * received after this is ignored.
+ */
+void client_close(client_t *client)
+{
+    if (client->src.fd < 0) return;
+    if (client->outqcount == 0) {
+        del_client(client->src.fd);
+        return;
+    }
+    client->closing = 1;
+}
+
+/* Client output queue is over the high water mark */
+static int client_slow(client_t *client, size_t len)
+{
+    int fd = client->src.fd;
+
+    if (ClientSlowPolicy == SLOW_CLOSE) {
+        syslog(LOG_NOTICE, "%s client %d too slow, %lu bytes queued, closing",
+                Clienttypename[client->type], fd,
+                (unsigned long)client->outqbytes);
+        del_client(fd);
+        return -1;
+    }
+    client->dropped++;
+    if (!client->throttled) {
+        client->throttled = 1;
+        syslog(LOG_NOTICE, "%s client %d too slow, dropping messages",
+                Clienttypename[client->type], fd);
+    }
+    dbprintf("%s: fd %d dropped %lu bytes\n", __func__, fd, (unsigned long)len);
+    return 0;
+}
+
+/* Try to send right away. Returns bytes sent or -1 if the client was
+ * deleted.
+ */
+static ssize_t client_send_now(client_t *client, const void *buf, size_t len)
+{
+    ssize_t bytesOut;
+
+    bytesOut = send(client->src.fd, buf, len, MSG_NOSIGNAL|MSG_DONTWAIT);
+    if (bytesOut < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            dbprintf("%s: %d -1/%d\n", __func__, client->src.fd, errno);
+            del_client(client->src.fd);
+            return -1;
+        }
+        bytesOut = 0;
+    }
+    return bytesOut;
+}
+
+/* Add a reference to msg to the end of the output queue. off bytes of msg
+ * have already been sent.
+ */
+static int client_enqueue(client_t *client, msgbuf_t *msg, size_t off)
+{
+    size_t newsize, i, slot;
+    msgbuf_t **newq;
+
+    if (client->outqcount == client->outqsize) {
+        newsize = (client->outqsize) ? client->outqsize * 2 : OUTQ_MINSIZE;
+        newq = malloc(newsize * sizeof(newq[0]));
+        if (newq == NULL) {
+            dbprintf("%s: no memory\n", __func__);
+            del_client(client->src.fd);
+            return -1;
+        }
+        for (i = 0; i < client->outqcount; i++) {
+            slot = (client->outqhead + i) & (client->outqsize - 1);
+            newq[i] = client->outq[slot];
+        }
+        free(client->outq);
+        client->outq = newq;
+        client->outqsize = newsize;
+        client->outqhead = 0;
+    }
+    slot = (client->outqhead + client->outqcount) & (client->outqsize - 1);
+    client->outq[slot] = msgbuf_ref(msg);
+    if (client->outqcount++ == 0) client->outqoff = off;
+    client->outqbytes += msg->len - off;
+    client_want_write(client, 1);
+    return 0;
+}
+
+/* Queue a message for a client. Never blocks. If nothing is queued the
+ * message is sent immediately, else a reference waits in the output queue
+ * until the socket is writable. Whole messages are dropped (or the client is
+ * closed) when the queue would grow past ClientMaxQueue.
+ * Returns len, 0 if the message was dropped, or -1 if the client was deleted.
+ */
+int client_queue(client_t *client, msgbuf_t *msg)
+{
+    ssize_t bytesOut = 0;
+
+    if ((msg == NULL) || (msg->len == 0)) return 0;
+    /* The AMQP command pipe is read-only */
+    if (client->type == CLIENT_AMQP) return msg->len;
+
+    if (client->outqcount == 0) {
+        bytesOut = client_send_now(client, msg->data, msg->len);
+        if (bytesOut < 0) return -1;
+        if ((size_t)bytesOut == msg->len) return msg->len;
+        /* Part of this message may already be on the wire so the rest must
+         * be queued or the client sees a truncated line.
+         */
+    }
+    else if ((client->outqbytes + msg->len) > ClientMaxQueue) {
+        return client_slow(client, msg->len);
+    }
+    if (client_enqueue(client, msg, bytesOut) < 0) return -1;
+    return msg->len;
+}
+
+/* Like client_queue but for a message only this client gets. The message
+ * is only copied if it cannot be sent right away.
+ */
+int client_write(client_t *client, const void *buf, size_t len)
+{
+    ssize_t bytesOut = 0;
+    msgbuf_t *msg;
+    int rc;
+
+    if (len == 0) return 0;
+    if (client->type == CLIENT_AMQP) return len;
+
+    if (client->outqcount == 0) {
+        bytesOut = client_send_now(client, buf, len);
+        if (bytesOut < 0) return -1;
+        if ((size_t)bytesOut == len) return len;
+    }
+    else if ((client->outqbytes + len) > ClientMaxQueue) {
+        return client_slow(client, len);
+    }
+    msg = msgbuf_new((const char *)buf + bytesOut, len - bytesOut);
+    if (msg == NULL) {
+        del_client(client->src.fd);
+        return -1;
+    }
+    rc = client_enqueue(client, msg, 0);
+    msgbuf_unref(msg);
+    return (rc < 0) ? -1 : (int)len;
+}
+
+/* Replace the client event filter */
+void client_subscribe(client_t *client, const evfilter_t *filter)
+{
+    if (client->filter.classes & (1U << EV_RAW)) NRaw--;
+    client->filter = *filter;
+    if (client->filter.classes & (1U << EV_RAW)) NRaw++;
+}
+
+/* Return 1 if any client wants raw frames */
+int client_wants_raw(void)
+{
+    return (NRaw > 0);
+}
+
+/* Tell the client that events after seq up to but not including next are
+ * lost. Returns -1 if the client was deleted.
+ */
+static int client_gap(client_t *client, uint32_t seq, uint32_t next)
+{
+    msgbuf_t *msg;
+    int rc;
+
+    if ((client->framing == FRAME_BINARY) || (client->framing == FRAME_SSE)) {
+        if (client->framing == FRAME_BINARY)
+            msg = binproto_gap(seq, next);
+        else
+            msg = http_sse_gap(seq, next);
+        if (msg == NULL) return 0;
+        rc = client_queue(client, msg);
+        msgbuf_unref(msg);
+        return rc;
+    }
+    return sockprintf(client->src.fd, "Gap after %u, resuming at %u\n",
+            seq, next);
+}
+
+/* Queue replayed events until the output queue is half full or the client
+ * has caught up with the live stream. Events overwritten before they could
+ * be queued are reported as a gap. Returns -1 if the client was deleted.
+ */
+static int client_replay(client_t *client)
+{
+    const replayent_t *ent;
+    bcast_t bcast;
+    uint32_t first;
+    int rc;
+
+    while (client->replaynext && (client->outqbytes < (ClientMaxQueue / 2))) {
+        if (client->replaynext > replay_last()) {
+            client->replaynext = 0;
+            break;
+        }
+        ent = replay_get(client->replaynext);
+        if (ent == NULL) {
+            first = replay_first();
+            if (client_gap(client, client->replaynext - 1, first) < 0)
+                return -1;
+            client->replaynext = first;
+            continue;
+        }
+        client->replaynext++;
+        if (!evfilter_match(&client->filter, &ent->ev, client->src.fd))
+            continue;
+        memset(&bcast, 0, sizeof(bcast));
+        bcast.ev = &ent->ev;
+        bcast.frame[FRAME_PLAIN] = msgbuf_new(ent->text, ent->len);
+        rc = client_queue(client, bcast_frame(&bcast, client->framing));
+        bcast_release(&bcast);
+        if (rc < 0) return -1;
+    }
+    return 0;
+}
+
+/* Send the client every event after seq that is still in the replay ring,
+ * then switch it back to the live stream. A gap marker is sent first if
+ * events after seq have already been overwritten, or if seq is from before
+ * a restart. Replay starts once the output queue drains so replies queued
+ * now go out first.
+ */
+void client_resume(client_t *client, uint32_t seq)
+{
+    uint32_t first, next;
+
+    first = replay_first();
+    if ((seq > replay_last()) || (seq + 1 < first)) {
+        if (client_gap(client, seq, first) < 0) return;
+        next = first;
+    }
+    else
+        next = seq + 1;
+    client->replaynext = (next > replay_last()) ? 0 : next;
+    if (client->replaynext) client_want_write(client, 1);
+}
+
+/* Tell the client that sent command cmdid how it is going. waitus is the
+ * time from queued to sent, totalus from queued to now. Nothing is sent if
+ * the client has gone away, even if its fd has been reused.
+ */
+void client_cmd_notify(int fd, uint32_t serial, uint32_t cmdid, int state,
+        uint64_t waitus, uint64_t totalus)
+{
+    static const char *statename[] = {
+        "queued", "sent", "acked", "timed out", "coalesced", "expired",
+        "cancelled", "dropped"
+    };
+    client_t *client = client_find(fd);
+    msgbuf_t *msg;
+
+    if ((client == NULL) || (client->serial != serial)) return;
+    if (!(client->opts & CLIENTOPT_NOTIFY)) return;
+    if (client->framing == FRAME_BINARY) {
+        msg = binproto_cmdstate(cmdid, state, waitus, totalus);
+        if (msg == NULL) return;
+        client_queue(client, msg);
+        msgbuf_unref(msg);
+        return;
+    }
+    if (state == CMD_QUEUED)
+        sockprintf(fd, "Cmd %u %s eta %lu ms\n", cmdid, statename[state],
+                (unsigned long)(waitus / 1000));
+    else
+        sockprintf(fd, "Cmd %u %s wait %lu ms total %lu ms\n", cmdid,
+                statename[state], (unsigned long)(waitus / 1000),
+                (unsigned long)(totalus / 1000));
+}
+
+/* Send to all plain, xml, and binary socket clients. Events only go to
+ * clients whose filter matches.
+ */
+void client_broadcast(bcast_t *bcast)
+{
+    static const clienttype_t types[] = {
+        CLIENT_PLAIN, CLIENT_XML, CLIENT_BINARY, CLIENT_HTTP
+    };
+    client_t *client, *next;
+    int i;
+
+    for (i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+        for (client = Clientlist[types[i]]; client; client = next) {
+            /* client_queue may delete a slow client */
+            next = client->next;
+            /* Still replaying. The event is in the replay ring, text
+             * that is not an event is not and goes out now.
+             */
+            if (client->replaynext && bcast->ev) continue;
+            if (bcast->ev &&
+                    !evfilter_match(&client->filter, bcast->ev, client->src.fd))
+                continue;
+            client_queue(client, bcast_frame(bcast, client->framing));
+        }
+    }
+}
+
+/* Like client_write but by fd. Returns -1 if fd is not a client. */
+int client_send(int fd, const void *buf, size_t len)
+{
+    client_t *client = client_find(fd);
+
+    if (client == NULL) return -1;
+    return client_write(client, buf, len);
+}
+
+/* Run the complete commands in the client input buffer */
+static void client_input(client_t *client)
+{
+    if (client->type == CLIENT_BINARY)
+        binproto_input(client);
+    else if (client->type == CLIENT_HTTP)
+        http_input(client);
+    else
+        cm15a_encode(client);
+}
+
+/* Client has frames waiting and no room for another command, at its
+ * quota or because the output queue is full. A client with nothing
+ * waiting is never held, if its command does not fit it is refused as
+ * with --tx-overflow reject.
+ */
+static int hold_needed(client_t *client)
+{
+    return (x10_write_room(client->src.fd) < HOLD_FRAMES) &&
+        (x10_write_queued(client->src.fd) > 0);
+}
+
+/* With --tx-overflow block, stop taking commands from client while it is
+ * filling the output queue. tx is 0 for input that queues no frames, such
+ * as QUEUE CANCEL or STATS, which is never held. Otherwise the rest of its
+ * input waits in inbuf and nothing more is read from the socket until
+ * client_unhold(). Returns 1 if input is held.
+ */
+int client_hold(client_t *client, int tx)
+{
+    if ((TxOverflow != OVERFLOW_BLOCK) || !tx || !hold_needed(client))
+        return 0;
+    if (!client->held) {
+        client->held = 1;
+        NHeld++;
+        client_want_write(client, (client->events & EPOLLOUT) != 0);
+    }
+    return 1;
+}
+
+/* Go on with the held input of clients that have room again. Called from
+ * the main loop so commands are never queued from inside x10_ack().
+ */
+void client_unhold(void)
+{
+    static const clienttype_t types[] = {
+        CLIENT_PLAIN, CLIENT_XML, CLIENT_OR20, CLIENT_BINARY
+    };
+    client_t *client, *next;
+    int i;
+
+    if (NHeld == 0) return;
+    NHeld = 0;
+    for (i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+        for (client = Clientlist[types[i]]; client; client = next) {
+            next = client->next;
+            if (!client->held) continue;
+            if (hold_needed(client)) {
+                NHeld++;
+                continue;
+            }
+            client->held = 0;
+            client_want_write(client, (client->events & EPOLLOUT) != 0);
+            /* May hold it again */
+            if (!client->closing) client_input(client);
+        }
+    }
+}
+
+static void client_handler(pollsrc_t *src, uint32_t events)
+{
+    client_t *client = (client_t *)src;
+    int clifd = src->fd;
+    ssize_t bytesIn;
+
+    /* dbprintf("client %d events 0x%X\n", clifd, events); */
+    if (events & EPOLLOUT) {
+        if (client_flush(client) < 0) return;
+    }
+    if (!(events & (EPOLLIN|EPOLLERR|EPOLLHUP))) return;
+
+    /* Read straight into the connection input buffer. cm15a_encode() takes
+     * every complete line and leaves any partial line at the front.
+     */
+    bytesIn = read(clifd, client->inbuf + client->inlen,
+            sizeof(client->inbuf) - client->inlen);
+    if (bytesIn < 0) {
+        if ((errno == EAGAIN) || (errno == EINTR)) return;
+        dbprintf("read err %d\n", errno);
+        if (errno != ECONNRESET) {
+            dbprintf("serious error %d\n", errno);
+        }
+        del_client(clifd);
+    }
+    else if (bytesIn == 0) {
+        dbprintf("read EOF %d\n", (int)bytesIn);
+        del_client(clifd);
+    }
+    else if (!client->closing) {
+        client->inlen += bytesIn;
+        client_input(client);
+    }
+}
+
+/* Out of fds or memory. The listen socket stays readable so stop polling
+ * it for a while instead of spinning on accept().
+ */
+static void listen_pause(listener_t *listener, int err)
+{
+    uint64_t now = monotonic_us();
+
+    listener->pauseduntil = now + LISTEN_BACKOFF_US;
+    reactor_mod(&listener->src, 0);
+    if ((Listenlogus == 0) || (now - Listenlogus >= LISTEN_LOG_US)) {
+        Listenlogus = now;
+        dbprintf("%s accept() -1/%d, paused\n",
+                Clienttypename[listener->type], err);
+        syslog(LOG_ERR, "%s accept() -1/%d, paused",
+                Clienttypename[listener->type], err);
+    }
+}
+
+/* Accept every pending connection. The listen socket is non-blocking so
+ * drain the backlog until accept4() says there is nothing left.
+ */
+static void listen_handler(pollsrc_t *src, uint32_t events)
+{
+    listener_t *listener = (listener_t *)src;
+    struct sockaddr_in cliaddr;
+    socklen_t clilen;
+    int clifd;
+
+    for (;;) {
+        clilen = sizeof(cliaddr);
+        clifd = accept4(src->fd, (struct sockaddr *)&cliaddr, &clilen,
+                SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (clifd < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EMFILE) || (errno == ENFILE) ||
+                    (errno == ENOBUFS) || (errno == ENOMEM)) {
+                listen_pause(listener, errno);
+                return;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                dbprintf("%s accept() -1/%d\n",
+                        Clienttypename[listener->type], errno);
+                syslog(LOG_ERR, "%s accept() -1/%d",
+                        Clienttypename[listener->type], errno);
+            }
+            return;
+        }
+        dbprintf("%s accept() %d\n", Clienttypename[listener->type], clifd);
+        syslog(LOG_INFO, "%s accept() %d", Clienttypename[listener->type],
+                clifd);
+        if (add_client(clifd, listener->type, listener->opts) == NULL)
+            close(clifd);
+    }
+}
+
+/* Listen for clients. opts are CLIENTOPT_* bits given to every client
+ * accepted on this port.
+ */
+int client_listen(clienttype_t type, unsigned short port, unsigned int opts)
+{
+    listener_t *listener = &Listeners[type];
+    struct sockaddr_in servaddr;
+    static const int optval=1;
+    int fd, rc;
+
+    fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    dbprintf("%s listen fd %d\n", Clienttypename[type], fd);
+    if (fd < 0) return -1;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(port);
+
+    rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    dbprintf("setsockopt() %d/%d\n", rc, errno);
+    rc = bind(fd, (struct sockaddr*) &servaddr, sizeof(servaddr));
+    dbprintf("bind() %d/%d\n", rc, errno);
+    if (rc < 0) {
+        syslog(LOG_ERR, "bind port %u failed %d", port, errno);
+        close(fd);
+        return -1;
+    }
+    rc = listen(fd, 128);
+    dbprintf("listen() %d/%d\n", rc, errno);
+
+    listener->src.fd = fd;
+    listener->src.handler = listen_handler;
+    listener->type = type;
+    listener->opts = opts;
+    listener->pauseduntil = 0;
+    return reactor_add(&listener->src, EPOLLIN);
+}
+
+/* Commands from the sensorflare receiver thread are written to a pipe and
+ * read by the main loop like any other client. This keeps command processing
+ * and client output queues on one thread.
+ * Returns the write end of the pipe or -1.
+ */
+int client_pipe(void)
+{
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        dbprintf("pipe2 -1/%d\n", errno);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    if (add_client(fds[0], CLIENT_AMQP, 0) == NULL) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return fds[1];
+}
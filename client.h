@@ -0,0 +1,163 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include "reactor.h"
+#include "event.h"
+
+/* One entry per listen port */
+typedef enum clienttype {
+    CLIENT_PLAIN = 0,       /* SERVER_PORT, text events and commands */
+    CLIENT_XML,             /* SERVER_PORT+1, Flash XMLSocket */
+    CLIENT_OR20,            /* SERVER_PORT+2, OpenRemote 2.0 */
+    CLIENT_BINARY,          /* SERVER_PORT+3, binary events and commands */
+    CLIENT_HTTP,            /* SERVER_PORT+4, JSON state and SSE events */
+    CLIENT_AMQP,            /* Commands from the sensorflare receiver thread */
+    CLIENT_NTYPES
+} clienttype_t;
+
+/* What to do when a client is not reading fast enough */
+typedef enum slowpolicy {
+    SLOW_DROP = 0,          /* Discard new messages until the queue drains */
+    SLOW_CLOSE              /* Disconnect the client */
+} slowpolicy_t;
+
+/* Per connection options, CLIENTOPT_* bits */
+#define CLIENTOPT_ONESHOT   0x0001  /* Close after the first command */
+#define CLIENTOPT_NOTIFY    0x0002  /* Report command progress */
+#define CLIENTOPT_STREAM    0x0004  /* HTTP connection is an event stream */
+#define CLIENTOPT_KEEPALIVE 0x0008  /* OR20, one status reply per line */
+
+/* Longest command line or binary record. Longer lines are discarded. */
+#define CLIENT_INBUF        (2048)
+
+/* How a message is framed on the wire */
+typedef enum framing {
+    FRAME_PLAIN = 0,        /* Text line ending in newline */
+    FRAME_XML,              /* Text ending in NUL instead of newline */
+    FRAME_BINARY,           /* Event record, see binproto.h */
+    FRAME_SEQ,              /* Like FRAME_PLAIN, events start with [seq] */
+    FRAME_SSE,              /* Server-Sent Events, see http.h */
+    FRAME_NTYPES
+} framing_t;
+
+/* Reference counted message buffer. A broadcast message is rendered once
+ * and the same buffer is queued on every client that wants it.
+ * data[] is always NUL terminated but the NUL is not counted in len.
+ */
+typedef struct msgbuf {
+    int refs;
+    size_t len;
+    char data[];
+} msgbuf_t;
+
+/* One message in each framing, rendered on first use from FRAME_PLAIN or,
+ * for FRAME_BINARY, from ev. Messages without an event are text only.
+ */
+typedef struct bcast {
+    msgbuf_t *frame[FRAME_NTYPES];
+    const x10event_t *ev;
+} bcast_t;
+
+typedef struct client {
+    pollsrc_t src;                  /* Must be first */
+    clienttype_t type;
+    framing_t framing;
+    uint32_t serial;                /* Unique for the life of the process */
+    struct client *prev, *next;     /* List of clients of the same type */
+    uint32_t events;                /* Events registered with the reactor */
+    msgbuf_t **outq;                /* Ring of queued messages */
+    size_t outqsize;                /* Number of slots, power of 2 */
+    size_t outqhead;                /* Slot of first unsent message */
+    size_t outqcount;               /* Number of queued messages */
+    size_t outqoff;                 /* Bytes of first message already sent */
+    size_t outqbytes;               /* Total unsent bytes */
+    unsigned long dropped;          /* Messages discarded by SLOW_DROP */
+    int throttled;                  /* 1 while messages are being dropped */
+    unsigned int opts;              /* CLIENTOPT_* */
+    int closing;                    /* Close once the output queue drains */
+    int replied;                    /* Status reply sent for this line */
+    int inputline;                  /* Running one of its input lines */
+    evfilter_t filter;              /* Events this client wants */
+    uint32_t replaynext;            /* Next event to replay, 0 if live */
+    struct x10cmd *batch;           /* Commands between BATCH and END */
+    int nbatch;                     /* Number of commands in batch */
+    int batchlines;                 /* Lines seen since BATCH */
+    int batcherr;                   /* First bad line in batch, 1 based */
+    int inskip;                     /* Discarding the rest of a long line */
+    int held;                       /* Input waits for output queue room */
+    size_t inlen;                   /* Bytes of partial input in inbuf */
+    char inbuf[CLIENT_INBUF];       /* Input not yet split into lines */
+} client_t;
+
+/* Output queue high water mark in bytes */
+extern size_t ClientMaxQueue;
+extern slowpolicy_t ClientSlowPolicy;
+
+int client_listen(clienttype_t type, unsigned short port, unsigned int opts);
+
+int client_pipe(void);
+
+msgbuf_t *msgbuf_new(const void *data, size_t len);
+
+msgbuf_t *msgbuf_ref(msgbuf_t *msg);
+
+void msgbuf_unref(msgbuf_t *msg);
+
+msgbuf_t *bcast_frame(bcast_t *bcast, framing_t framing);
+
+void bcast_release(bcast_t *bcast);
+
+int client_queue(client_t *client, msgbuf_t *msg);
+
+int client_write(client_t *client, const void *buf, size_t len);
+
+void client_broadcast(bcast_t *bcast);
+
+void client_close(client_t *client);
+
+void client_subscribe(client_t *client, const evfilter_t *filter);
+
+int client_wants_raw(void);
+
+void client_resume(client_t *client, uint32_t seq);
+
+void client_cmd_notify(int fd, uint32_t serial, uint32_t cmdid, int state,
+        uint64_t waitus, uint64_t totalus);
+
+int client_send(int fd, const void *buf, size_t len);
+
+client_t *client_find(int fd);
+
+client_t *client_first(clienttype_t type);
+
+void client_reap(void);
+
+int client_poll_timeout(int timeout);
+
+int client_hold(client_t *client, int tx);
+
+void client_unhold(void);
+
+void client_closeall(void);
+
+#endif
@@ -29,40 +29,8 @@
 #include "x10state.h"
 #include "x10_write.h"
 #include "encode.h"
-
-union x10addr {
-    unsigned char houseunit;    // Normalized codes 7..4 house 3..0 unit
-    unsigned char security8;    // RF security code, old 8 bit 
-    unsigned int  security17;   // RF security code, 17 bits 23..7 inclusive
-};
-
-enum eventfunc {
-    EV_ON,EV_OFF,EV_DIM,EV_BRIGHT
-};
-typedef enum eventfunc eventfunc_t;
-
-enum eventinterface {
-    EV_RX_PLC=0,
-    EV_RX_RF=1,
-    EV_TX_PLC=2,
-    EV_TX_RF=3
-};
-
-typedef enum eventinterface eventinterface_t;
-
-typedef struct x10event {
-
-    eventinterface_t evint;
-    eventfunc_t evfunc;
-    union {
-        struct {
-            char housec;            // 'A'..'P'
-            unsigned char unitc;    // 1..16
-        };
-        unsigned char security8;    // 8 bit security code
-        unsigned int  security17;   // 17 bit security code bits 23..7 
-    };
-} x10event_t;
+#include "event.h"
+#include "client.h"
 
 /* For all input values 0..255, return 1 for odd parity, 0 for even. */
 static const char Paritytable[256] = {
@@ -213,11 +181,10 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
     int unitint, funcint;
     int codelen;
     int dims;
+    x10event_t ev;
 
     dbprintf("%s(%d,%u) ", __func__, fd, len);
     hexdump(buf, len);
-    // new event
-    // ev->evint = EV_RX_PLC;
     if (len < 4) {
         dbprintf("len too short %d\n", len);
         return;
@@ -227,6 +194,7 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
         return;
     }
 
+    event_init(&ev, (buf[0] == 0x5a) ? EV_RX : EV_TX, EV_PL, buf, len);
     switch (buf[2]) 
     {
         case 0x00:  // house/unit code follows
@@ -237,7 +205,9 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
             }
             unitint = huc_decode(buf[3], &housechar);
             hua_add(housechar-'A', unitint-1);
-            sockprintf(fd, "%cx PL HouseUnit: %c%d\n", 
+            ev.house = housechar - 'A';
+            ev.unit = unitint;
+            evprintf(fd, &ev, "%cx PL HouseUnit: %c%d\n", 
                     (buf[0] == 0x5a) ? 'R' : 'T',
                     housechar, unitint);
             break;
@@ -293,7 +263,9 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
                 default:
                     break;
             }
-            sockprintf(fd, "%cx PL House: %c Func: %s\n",
+            ev.house = housechar - 'A';
+            ev.func = funcint;
+            evprintf(fd, &ev, "%cx PL House: %c Func: %s\n",
                     (buf[0] == 0x5a) ? 'R' : 'T',
                     housechar, Funcname[funcint]);
             dbprintf("exit case 0x01\n");
@@ -306,7 +278,10 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
             }
             dims = (buf[3] & 0xF8) >> 3;
             funcint = hfc_decode(buf[4], &housechar);
-            sockprintf(fd, "%cx PL House: %c Func: %s(%d)\n",
+            ev.house = housechar - 'A';
+            ev.func = funcint;
+            ev.data = dims;
+            evprintf(fd, &ev, "%cx PL House: %c Func: %s(%d)\n",
                     (buf[0] == 0x5a) ? 'R' : 'T',
                     housechar, Funcname[funcint], dims);
             break;
@@ -329,7 +304,12 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
             }
             funcint = hfc_decode(buf[3], &housechar);
             unitint = uc_decode(buf[4]);
-            sockprintf(fd, "%cx PL HouseUnit: %c%d Func: %s Data: %02X Command: %02X\n",
+            ev.house = housechar - 'A';
+            ev.unit = unitint;
+            ev.func = funcint;
+            ev.data = buf[5];
+            ev.data2 = buf[6];
+            evprintf(fd, &ev, "%cx PL HouseUnit: %c%d Func: %s Data: %02X Command: %02X\n",
                     (buf[0] == 0x5a) ? 'R' : 'T',
                     housechar, unitint, Funcname[funcint], buf[5], buf[6]);
             hua_setstatus_xdim(housechar-'A', unitint-1, buf[5]);
@@ -357,7 +337,12 @@ void cm15a_decode_plc(int fd, unsigned char *buf, size_t len)
             }
             funcint = hfc_decode(buf[6], &housechar);
             unitint = uc_decode(buf[5]);
-            sockprintf(fd, "%cx PL HouseUnit: %c%d Func: %s Data: %02X Command: %02X\n",
+            ev.house = housechar - 'A';
+            ev.unit = unitint;
+            ev.func = funcint;
+            ev.data = buf[4];
+            ev.data2 = buf[3];
+            evprintf(fd, &ev, "%cx PL HouseUnit: %c%d Func: %s Data: %02X Command: %02X\n",
                     (buf[0] == 0x5a) ? 'R' : 'T',
                     housechar, unitint, Funcname[funcint], buf[4], buf[3]);
             hua_setstatus_xdim(housechar-'A', unitint-1, buf[4]);
@@ -572,10 +557,7 @@ static int repeatRF(int fd, unsigned char *buf, size_t len)
         sockprintf(fd, "RfToRf repeat\n");
         // Change Rx code to Tx code
         *buf = 0xEB;
-        if (Cm19a)
-            retval = x10_write(buf+1, len-1);
-        else
-            retval = x10_write(buf, len);
+        retval = x10_write(buf, len);
         *buf = saved;
     }
     return retval;
@@ -709,6 +691,8 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
     unsigned char chksum;
     char cmdbuf[80];
     const char *commandp;
+    x10event_t ev;
+    int dir;
 
     dbprintf("%s(%d,%u) ", __func__, fd, len);
     hexdump(buf, len);
@@ -728,13 +712,17 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
         sockhexdump(fd, buf, len);
         return;
     }
+    dir = (buf[0] == 0x5d) ? EV_RX : EV_TX;
     switch (buf[1])
     {
         case 0x14:  // X10 RF camera
             commandp = findCamRemoteName(&buf[1], len-1);
             if (commandp) {
                 if (dup_filter(buf, len)) return;
-                sockprintf(fd, "%cx RFCAM %s\n", (buf[0] == 0x5d) ? 'R' : 'T',
+                event_init(&ev, dir, EV_RFCAM, buf, len);
+                ev.house = HouseUnitTableRF[(buf[4] >> 4) & 0x0F] - 'A';
+                ev.func = buf[3];
+                evprintf(fd, &ev, "%cx RFCAM %s\n", (buf[0] == 0x5d) ? 'R' : 'T',
                        commandp);
                 repeatRF(fd, buf, len);
             }
@@ -762,7 +750,11 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
                 secaddr[1] = 0;
                 secaddr[2] = buf[2];
                 hua_sec_event(secaddr, buf[4], 1);
-                sockprintf(fd, "%cx RFSEC Addr: 0x%02X Func: %s\n",
+                event_init(&ev, dir, EV_RFSEC, buf, len);
+                ev.flags = EVF_SEC8;
+                ev.secaddr = buf[2];
+                ev.func = buf[4];
+                evprintf(fd, &ev, "%cx RFSEC Addr: 0x%02X Func: %s\n",
                        (buf[0] == 0x5d) ? 'R' : 'T',
                         buf[2], findSecRemoteKeyName(buf[4]));
                 repeatRF(fd, buf, len);
@@ -783,9 +775,12 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
                 }
                 if (dup_filter(buf, len)) return;
                 unitint = hufc_decode(buf[2], buf[4], &housechar, &funcint);
+                event_init(&ev, dir, EV_RF, buf, len);
+                ev.house = housechar - 'A';
+                ev.func = funcint + 2;  /* FUNC_ON..FUNC_BRIGHT */
                 /* dbprintf("h %c func %d\n", housechar, funcint); */
                 if (funcint > 1) {  // Dim or Bright
-                    sockprintf(fd, "%cx RF House: %c Func: %s\n", 
+                    evprintf(fd, &ev, "%cx RF House: %c Func: %s\n", 
                             (buf[0] == 0x5d) ? 'R' : 'T',
                             housechar, Funcname[funcint+2]);
                     repeatRF(fd, buf, len);
@@ -806,7 +801,8 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
                         hua_func_off(housechar-'A');
                     else
                         hua_func_on(housechar-'A');
-                    sockprintf(fd, "%cx RF HouseUnit: %c%d Func: %s\n", 
+                    ev.unit = unitint;
+                    evprintf(fd, &ev, "%cx RF HouseUnit: %c%d Func: %s\n", 
                             (buf[0] == 0x5d) ? 'R' : 'T',
                             housechar, unitint, Funcname[funcint+2]);
                     repeatRF(fd, buf, len);
@@ -833,7 +829,11 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
                 case 0:
                     if (dup_filter(buf, len)) return;
                     hua_sec_event(secaddr, funcint, 0);
-                    sockprintf(fd, "%cx RFSEC Addr: %02X:%02X:%02X Func: %s\n", 
+                    event_init(&ev, dir, EV_RFSEC, buf, len);
+                    ev.secaddr = (secaddr[0] << 16) | (secaddr[1] << 8) |
+                        secaddr[2];
+                    ev.func = funcint;
+                    evprintf(fd, &ev, "%cx RFSEC Addr: %02X:%02X:%02X Func: %s\n", 
                             (buf[0] == 0x5d) ? 'R' : 'T',
                             secaddr[0], secaddr[1], secaddr[2],
                             findSecEventName(funcint));
@@ -871,24 +871,27 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len)
     }
 }
 
-void cm15a_decode(int fd, unsigned char *buf, unsigned int len)
+/* Add 0x5d to front so USB packet from the CM19A looks just like a USB
+ * packet from the CM15A. Call the same decode function. The CM19A does RF
+ * but not PL.
+ */
+void cm19a_decode(int fd, unsigned char *buf, unsigned int len)
 {
     unsigned char bufcm19a[9];
+
+    if ((len < 4) || (len > sizeof(bufcm19a) - 1)) return;
+    bufcm19a[0] = 0x5d;
+    memcpy(bufcm19a+1, buf, len);
+    cm15a_decode(fd, bufcm19a, len+1);
+}
+
+void cm15a_decode(int fd, unsigned char *buf, unsigned int len)
+{
     unsigned char *p = buf;
 
     if (len < 4) return;
-    if (Cm19a) {
-        /* Add 0x5d to front so USB packet from the CM19A looks just like
-         * a USB packet from the CM15A. Call the same decode function.
-         * The CM19A does RF but not PL.
-         */
-        p = bufcm19a;
-        *p = 0x5d;
-        memcpy(p+1, buf, len);
-        len++;
-    }
 
-    if (raw_data) {
+    if (raw_data || client_wants_raw()) {
 	mh_sockhexdump(fd, p, len);
     }
 
@@ -31,3 +31,5 @@ void cm15a_decode_rf(int fd, unsigned char *buf, unsigned int len);
 
 void cm15a_decode(int fd, unsigned char *buf, unsigned int len);
 
+void cm19a_decode(int fd, unsigned char *buf, unsigned int len);
+
@@ -77,16 +77,23 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <syslog.h>
 #include "global.h"
 #include "encode.h"
 #include "decode.h"
 #include "x10state.h"
 #include "x10_write.h"
+#include "client.h"
+#include "event.h"
+#include "replay.h"
+#include "usbio.h"
+#include "rfmerge.h"
 
 static void strupper(char *buf) {
     while (*buf) {
@@ -112,6 +119,68 @@ static int gethexdata(unsigned char buf8[]) {
     return (ptr - buf8);
 }
 
+/* Longest TTL, one day */
+#define TTL_MAX_MS	(86400000UL)
+
+/* 1 if the first word of line is word, any case */
+static int firstword(const char *line, const char *word) {
+    size_t n = strlen(word);
+
+    return (strncasecmp(line, word, n) == 0) &&
+	((line[n] == '\0') || (line[n] == ' '));
+}
+
+/* 1 if line is a transmit command */
+static int txline(const char *line) {
+    static const char *txcmds[] = { "PL", "RF", "RFSEC", "RFCAM", "PT" };
+    size_t i;
+
+    for (i = 0; i < sizeof(txcmds)/sizeof(txcmds[0]); i++)
+	if (firstword(line, txcmds[i])) return 1;
+    return 0;
+}
+
+/* Take a TTL=<n>[MS|S|M] token out of a command line, seconds if there is
+ * no unit. Returns the TTL in ms, 0 if there is none, or -1 if it is bad
+ * or the line is not a transmit command.
+ */
+static long cutttl(char *aLine) {
+    char *ttl, *end;
+    unsigned long n, mult;
+    size_t len;
+
+    for (ttl = strstr(aLine, "TTL="); ttl; ttl = strstr(ttl + 1, "TTL="))
+	if ((ttl == aLine) || (ttl[-1] == ' ')) break;
+    if (ttl == NULL) return 0;
+    if (!txline(aLine)) return -1;
+    len = strcspn(ttl, " ");
+    errno = 0;
+    n = strtoul(ttl + 4, &end, 10);
+    if (errno || (end == ttl + 4)) return -1;
+    switch (ttl + len - end) {
+	case 0:
+	    mult = 1000;
+	    break;
+	case 1:
+	    if (*end == 'S')
+		mult = 1000;
+	    else if (*end == 'M')
+		mult = 60000;
+	    else
+		return -1;
+	    break;
+	case 2:
+	    if (strncmp(end, "MS", 2) != 0) return -1;
+	    mult = 1;
+	    break;
+	default:
+	    return -1;
+    }
+    if (n > (TTL_MAX_MS / mult)) return -1;
+    memmove(ttl, ttl + len, strlen(ttl + len) + 1);
+    return n * mult;
+}
+
 
 #define    FUNC_ALL_UNITS_OFF   (0)
 #define    FUNC_ALL_LIGHTS_ON   (1)
@@ -512,10 +581,7 @@ static int rfsec_tx(int fd, int rf8bitaddr, unsigned long rfaddr, int func) {
 	*p++ = func;
 	*p = ~func;
 	cm15a_decode_rf(-1, buf, 6);
-	if (Cm19a)
-	    return x10_write(buf + 1, 5);
-	else
-	    return x10_write(buf, 6);
+	return x10_write(buf, 6);
     } else {
 	*p++ = 0x29;
 	addr1 = rfaddr >> 16;
@@ -526,10 +592,7 @@ static int rfsec_tx(int fd, int rf8bitaddr, unsigned long rfaddr, int func) {
 	*p++ = rfaddr >> 8;
 	*p = rfaddr;
 	cm15a_decode_rf(-1, buf, 8);
-	if (Cm19a)
-	    return x10_write(buf + 1, 7);
-	else
-	    return x10_write(buf, 8);
+	return x10_write(buf, 8);
     }
 }
 
@@ -578,10 +641,372 @@ static int rf_tx_houseunitfunc(int fd, int house, int unit, int func) {
     buf[5] = ~buf[4];
 
     cm15a_decode_rf(-1, buf, sizeof (buf));
-    if (Cm19a)
-	return x10_write(buf + 1, sizeof (buf) - 1);
+    return x10_write(buf, sizeof (buf));
+}
+
+static int rfcam_tx(int fd, int house, int rfcamkey) {
+    unsigned char buf[5];
+
+    house = x10housecoderf[house] << 4;
+    buf[0] = 0xeb;
+    buf[1] = 0x14;
+    buf[2] = (house + (rfcamkey - 0x2B)) & 0xFF;
+    buf[3] = rfcamkey;
+    buf[4] = house;
+    hexdump(buf, 5);
+    cm15a_decode_rf(-1, buf, 5);
+    return x10_write(buf, 5);
+}
+
+/* Return 0 if cmd can be sent, else -1 */
+int x10cmd_check(const x10cmd_t *cmd) {
+    switch (cmd->type) {
+	case X10CMD_PL:
+	    if ((cmd->house < 0) || (cmd->house > 15)) return -1;
+	    if ((cmd->unit < -1) || (cmd->unit > 15)) return -1;
+	    if ((cmd->func < -1) || (cmd->func > FUNC_EXTENDED_DIM)) return -1;
+	    /* House code commands need a function */
+	    if ((cmd->unit < 0) &&
+		    ((cmd->func < 0) || (cmd->func == FUNC_EXTENDED_DIM)))
+		return -1;
+	    return 0;
+	case X10CMD_RF:
+	    if ((cmd->house < 0) || (cmd->house > 15)) return -1;
+	    if ((cmd->unit < -1) || (cmd->unit > 15)) return -1;
+	    switch (cmd->func) {
+		case FUNC_ON:
+		case FUNC_OFF:
+		    return (cmd->unit < 0) ? -1 : 0;
+		case FUNC_DIM:
+		case FUNC_BRIGHT:
+		    return 0;
+	    }
+	    return -1;
+	case X10CMD_RFSEC:
+	    if ((cmd->func < 0) || (cmd->func > 0xFF)) return -1;
+	    if (cmd->rfaddr > ((cmd->rf8bitaddr) ? 0xFFUL : 0xFFFFFFUL))
+		return -1;
+	    return 0;
+	case X10CMD_RFCAM:
+	    if ((cmd->house < 0) || (cmd->house > 15)) return -1;
+	    /* See RFCAMKeyCodes in decode.c */
+	    if ((cmd->func < 0x54) || (cmd->func > 0x6E)) return -1;
+	    return 0;
+	case X10CMD_PT:
+	    if ((cmd->len < 1) || (cmd->len > sizeof(cmd->bytes))) return -1;
+	    return 0;
+    }
+    return -1;
+}
+
+static int x10cmd_send(int fd, const x10cmd_t *cmd) {
+    unsigned char x10bytes8[8];
+
+    switch (cmd->type) {
+	case X10CMD_PL:
+	    if (cmd->unit < 0)
+		return pl_tx_housefunc(fd, cmd->house, cmd->func, cmd->param[0]);
+	    switch (cmd->func) {
+		case -1:
+		    return pl_tx_houseunit(fd, cmd->house, cmd->unit);
+		case FUNC_EXTENDED_DIM:
+		    return pl_tx_extended_code_1(fd, cmd->house, cmd->unit, 3, 1,
+			    cmd->param[0]);
+		case FUNC_EXTENDED_CODE_1:
+		    return pl_tx_extended_code_1(fd, cmd->house, cmd->unit,
+			    cmd->param[0], cmd->param[1], cmd->param[2]);
+		case FUNC_DIM:
+		case FUNC_BRIGHT:
+		    pl_tx_houseunit(fd, cmd->house, cmd->unit);
+		    return pl_tx_housefunc(fd, cmd->house, cmd->func,
+			    cmd->param[0]);
+		default:
+		    pl_tx_houseunit(fd, cmd->house, cmd->unit);
+		    return pl_tx_housefunc(fd, cmd->house, cmd->func, 0);
+	    }
+	case X10CMD_RF:
+	    return rf_tx_houseunitfunc(fd, cmd->house, cmd->unit, cmd->func);
+	case X10CMD_RFSEC:
+	    return rfsec_tx(fd, cmd->rf8bitaddr, cmd->rfaddr, cmd->func);
+	case X10CMD_RFCAM:
+	    return rfcam_tx(fd, cmd->house, cmd->func);
+	case X10CMD_PT:
+	    memcpy(x10bytes8, cmd->bytes, cmd->len);
+	    hexdump(x10bytes8, cmd->len);
+	    return x10_write(x10bytes8, cmd->len);
+    }
+    return -1;
+}
+
+/* Last command id given out */
+static uint32_t Cmdid = 0;
+
+/* 1 if cmd goes out as RF. With only CM19As everything is RF. */
+static int x10cmd_rf(const x10cmd_t *cmd) {
+    if (Cm19a) return 1;
+    if (cmd->type == X10CMD_PT) return (cmd->bytes[0] == 0xEB);
+    return (cmd->type != X10CMD_PL);
+}
+
+/* Tell the output queue what a PL unit command does so a later command
+ * can make it redundant before it is sent.
+ */
+static void x10cmd_coalesce(const x10cmd_t *cmd) {
+    if ((cmd->type != X10CMD_PL) || (cmd->unit < 0)) return;
+    switch (cmd->func) {
+	case FUNC_ON:
+	    x10_cmd_pl(cmd->house, cmd->unit, PLOP_ON, 0);
+	    break;
+	case FUNC_OFF:
+	    x10_cmd_pl(cmd->house, cmd->unit, PLOP_OFF, 0);
+	    break;
+	case FUNC_DIM:
+	    x10_cmd_pl(cmd->house, cmd->unit, PLOP_DIM, cmd->param[0] & 0x1F);
+	    break;
+	case FUNC_BRIGHT:
+	    x10_cmd_pl(cmd->house, cmd->unit, PLOP_BRIGHT,
+		    cmd->param[0] & 0x1F);
+	    break;
+	case FUNC_EXTENDED_DIM:
+	    x10_cmd_pl(cmd->house, cmd->unit, PLOP_XDIM, 0);
+	    break;
+    }
+}
+
+/* Queue cmd for transmit. cmd must have passed x10cmd_check(). TX events
+ * are marked with fd so SUBSCRIBE NOECHO clients do not see their own.
+ * The frames carry the command id and client so the client can be told
+ * when the command is sent and acknowledged. Returns the command id.
+ */
+uint32_t x10cmd_exec(int fd, const x10cmd_t *cmd) {
+    client_t *client = client_find(fd);
+
+    Cmdid++;
+    if (Cmdid == 0) Cmdid++;
+    event_set_origin(fd);
+    if (client)
+	x10_cmd_begin(Cmdid, fd, client->serial, x10_eta(x10cmd_rf(cmd)));
     else
-	return x10_write(buf, sizeof (buf));
+	x10_cmd_begin(Cmdid, -1, 0, 0);
+    x10_cmd_ttl(cmd->ttlms);
+    if ((cmd->type == X10CMD_PL) || (cmd->type == X10CMD_RF) ||
+	    (cmd->type == X10CMD_RFCAM))
+	x10_cmd_addr(cmd->house, cmd->unit);
+    x10cmd_coalesce(cmd);
+    x10cmd_send(fd, cmd);
+    x10_cmd_end();
+    event_set_origin(-1);
+    return Cmdid;
+}
+
+/* Parse a transmit command. command is the first token, the arguments are
+ * taken with strtok(). Returns 0 if cmd is ready for x10cmd_exec(), -1 if
+ * the command is invalid, or 1 if command is not a transmit command. *bad
+ * is set to an unknown RF camera key name.
+ */
+static int parsecmd(const char *command, x10cmd_t *cmd, char **bad) {
+    char *arg1;
+    int i, rc;
+
+    memset(cmd, 0, sizeof(*cmd));
+    *bad = NULL;
+    if (strcmp(command, "PL") == 0) {
+	cmd->type = X10CMD_PL;
+	cmd->house = getdeviceaddr(&cmd->unit);
+	dbprintf("house %d unit %d\n", cmd->house, cmd->unit);
+	if (cmd->house < 0) return -1;
+	cmd->func = getfunc();
+	dbprintf("func %d\n", cmd->func);
+	if (cmd->func == FUNC_EXTENDED_CODE_1) {
+	    for (i = 0; i < 3; i++) {
+		cmd->param[i] = getparam();
+		if (cmd->param[i] == -1) cmd->param[i] = 0;
+	    }
+	} else if ((cmd->func == FUNC_DIM) || (cmd->func == FUNC_BRIGHT) ||
+		(cmd->func == FUNC_EXTENDED_DIM)) {
+	    cmd->param[0] = getparam();
+	    if (cmd->param[0] == -1) cmd->param[0] = 1; /* default is 1 dim */
+	}
+    } else if (strcmp(command, "RF") == 0) {
+	cmd->type = X10CMD_RF;
+	cmd->house = getdeviceaddr(&cmd->unit);
+	if (cmd->house < 0) return -1;
+	cmd->func = getfunc();
+	dbprintf("house %d unit %d %d\n", cmd->house, cmd->unit, cmd->func);
+    } else if (strcmp(command, "RFSEC") == 0) {
+	cmd->type = X10CMD_RFSEC;
+	cmd->rf8bitaddr = getrfaddr(&cmd->rfaddr);
+	dbprintf("rfaddr 8bit: %d %X\n", cmd->rf8bitaddr, cmd->rfaddr);
+	if (cmd->rf8bitaddr < 0) return -1;
+	cmd->func = getrffunc(cmd->rf8bitaddr);
+	dbprintf("rf func %X\n", cmd->func);
+    } else if (strcmp(command, "RFCAM") == 0) {
+	cmd->type = X10CMD_RFCAM;
+	/* Unit number is ignored */
+	cmd->house = getdeviceaddr(&cmd->unit);
+	if (cmd->house < 0) return -1;
+	arg1 = strtok(NULL, " ");
+	if (arg1 == NULL || *arg1 == '\0') return -1;
+	dbprintf("rfcam house keyname %d %s\n", cmd->house, arg1);
+	cmd->func = findCamRemoteCommand(arg1);
+	if (cmd->func < 0) {
+	    *bad = arg1;
+	    return -1;
+	}
+    } else if (strcmp(command, "PT") == 0) {
+	cmd->type = X10CMD_PT;
+	rc = gethexdata(cmd->bytes);
+	if (rc <= 0) return -1;
+	cmd->len = rc;
+    } else
+	return 1;
+    return x10cmd_check(cmd);
+}
+
+/* Number of x10_write() frames cmd takes */
+static int x10cmd_frames(const x10cmd_t *cmd) {
+    if ((cmd->type != X10CMD_PL) || (cmd->unit < 0)) return 1;
+    switch (cmd->func) {
+	case -1:
+	case FUNC_EXTENDED_DIM:
+	case FUNC_EXTENDED_CODE_1:
+	    return 1;
+    }
+    return 2;
+}
+
+/* Can n checked commands from fd be queued now. *etams is the estimated
+ * wait before they start. Returns BATCH_OK, BATCH_EFULL if the output queue
+ * does not have room, or BATCH_EBUSY if the wait is over --max-latency.
+ */
+int x10cmd_admit(int fd, const x10cmd_t *cmds, int n, int *etams) {
+    int i, frames[2] = { 0, 0 };
+
+    for (i = 0; i < n; i++)
+	frames[x10cmd_rf(&cmds[i])] += x10cmd_frames(&cmds[i]);
+    switch (x10_admit(fd, frames[0], frames[1], etams)) {
+	case ADMIT_FULL:
+	    return BATCH_EFULL;
+	case ADMIT_BUSY:
+	    return BATCH_EBUSY;
+    }
+    return BATCH_OK;
+}
+
+/* QUEUE LIST, or QUEUE CANCEL <id|house|house unit|FD n> */
+static int queuecmd(int fd) {
+    char *arg, *end;
+    long n;
+    int unit;
+
+    arg = strtok(NULL, " ");
+    if ((arg == NULL) || (strcmp(arg, "LIST") == 0)) {
+	x10_queue_list(fd);
+	return 0;
+    }
+    if (strcmp(arg, "CANCEL") != 0) return -1;
+    arg = strtok(NULL, " ");
+    if (arg == NULL) return -1;
+    if (isdigit(*arg)) {
+	n = strtol(arg, &end, 10);
+	if (*end) return -1;
+	n = x10_cancel(CANCEL_ID, n, -1);
+    } else if (strcmp(arg, "FD") == 0) {
+	arg = strtok(NULL, " ");
+	if (arg == NULL) return -1;
+	n = strtol(arg, &end, 10);
+	if (*end || (n < 0)) return -1;
+	n = x10_cancel(CANCEL_FD, n, -1);
+    } else if (ishouse(*arg)) {
+	unit = (arg[1]) ? strtol(arg + 1, &end, 10) : 0;
+	if (arg[1] && (*end || (unit < 1) || (unit > 16))) return -1;
+	n = x10_cancel(CANCEL_UNIT, *arg - 'A', unit - 1);
+    } else
+	return -1;
+    statusprintf(fd, "Cancelled %ld commands\n", n);
+    return 0;
+}
+
+/* Check and queue n commands as one unit. Either every command is queued,
+ * back to back, or none are. ids[i] is set to the id of cmds[i].
+ * Returns BATCH_OK, BATCH_EINVAL with *bad set to the index of the first
+ * invalid command, or BATCH_EFULL or BATCH_EBUSY from x10cmd_admit() with
+ * *etams set.
+ */
+int x10cmd_batch(int fd, const x10cmd_t *cmds, int n, uint32_t *ids,
+	int *bad, int *etams) {
+    int i, rc;
+
+    *etams = 0;
+    for (i = 0; i < n; i++) {
+	if (x10cmd_check(&cmds[i]) < 0) {
+	    *bad = i;
+	    return BATCH_EINVAL;
+	}
+    }
+    rc = x10cmd_admit(fd, cmds, n, etams);
+    if (rc != BATCH_OK) return rc;
+    for (i = 0; i < n; i++)
+	ids[i] = x10cmd_exec(fd, &cmds[i]);
+    return BATCH_OK;
+}
+
+/* End of a text BATCH. Send one reply for the whole batch. */
+static void batch_end(client_t *client) {
+    char reply[16 + (BATCH_MAX * 11)];
+    uint32_t ids[BATCH_MAX];
+    int fd = client->src.fd;
+    int i, rc, bad, eta;
+    size_t len;
+
+    if (client->batcherr) {
+	statusprintf(fd, "batch error line %d\n", client->batcherr);
+    } else {
+	rc = x10cmd_batch(fd, client->batch, client->nbatch, ids, &bad, &eta);
+	if (rc == BATCH_EFULL) {
+	    statusprintf(fd, "batch busy\n");
+	} else if (rc == BATCH_EBUSY) {
+	    statusprintf(fd, "batch busy eta %d ms\n", eta);
+	} else if (rc == BATCH_EINVAL) {
+	    statusprintf(fd, "batch error line %d\n", bad + 1);
+	} else {
+	    len = snprintf(reply, sizeof(reply), "batch ok %d", client->nbatch);
+	    for (i = 0; i < client->nbatch; i++)
+		len += snprintf(reply + len, sizeof(reply) - len, " %u", ids[i]);
+	    statusprintf(fd, "%s\n", reply);
+	}
+    }
+    free(client->batch);
+    client->batch = NULL;
+    client->nbatch = 0;
+    client->batchlines = 0;
+    client->batcherr = 0;
+}
+
+/* One line between BATCH and END. Commands are only parsed here, they are
+ * queued together by batch_end().
+ */
+static void batch_line(client_t *client, char *aLine) {
+    char *command, *bad;
+    long ttl;
+
+    strupper(aLine);
+    ttl = cutttl(aLine);
+    command = strtok(aLine, " ");
+    if (command == NULL) return;
+    if (strcmp(command, "END") == 0) {
+	batch_end(client);
+	return;
+    }
+    client->batchlines++;
+    if (client->batcherr) return;
+    if ((client->nbatch >= BATCH_MAX) || (ttl < 0) ||
+	    (parsecmd(command, &client->batch[client->nbatch], &bad) != 0)) {
+	client->batcherr = client->batchlines;
+	return;
+    }
+    client->batch[client->nbatch].ttlms = ttl;
+    client->nbatch++;
 }
 
 static const char DOMAINPOLICY[] =
@@ -591,6 +1016,22 @@ static const char DOMAINPOLICY[] =
 	"<allow-access-from domain=\"*.chumby.com\" to-ports=\"1100\" />"
 	"</cross-domain-policy>";
 
+/* 1 if fd is an OpenRemote panel in keep-alive mode */
+static int keepaliveclient(int fd) {
+    client_t *client = client_find(fd);
+
+    return (client && (client->opts & CLIENTOPT_KEEPALIVE));
+}
+
+/* 1 if line queues frames, or starts or ends a batch. Only those wait
+ * for room in the output queue, see client_hold().
+ */
+static int line_sends(const client_t *client, const char *line) {
+    /* Lines in a batch are only parsed until END */
+    if (client->batch) return firstword(line, "END");
+    return txline(line) || firstword(line, "BATCH");
+}
+
 /* aLine looks something like the following
  * pl a1 on
  * rf a1 on
@@ -599,120 +1040,59 @@ static const char DOMAINPOLICY[] =
 int processcommandline(int fd, char *aLine) {
     printf("%s\n", aLine);
     char *command, *arg1;
-    int house, unit, func, param;
-    unsigned char x10bytes8[8];
-    size_t len;
+    int house, unit, rc, eta;
+    long ttl;
     unsigned long rfaddr;
-    int rf8bitaddr, rfcamkey;
+    int rf8bitaddr;
+    x10cmd_t cmd;
 
     strupper(aLine);
     printf("%s\n", aLine);
     dbprintf("%lu:%s\n", (unsigned long) strlen(aLine), aLine);
     if (strcmp(aLine, "<POLICY-FILE-REQUEST/>") == 0) {
 	/* Yes, this sends the '\0' terminator which is required. */
-	send(fd, DOMAINPOLICY, sizeof (DOMAINPOLICY), MSG_NOSIGNAL);
+	client_send(fd, DOMAINPOLICY, sizeof (DOMAINPOLICY));
 	return 0;
     }
+    ttl = cutttl(aLine);
     command = strtok(aLine, " ");
     if (command) {
-	if (strcmp(command, "PL") == 0) {
-	    if (or20client(fd)) statusprintf(fd, "ok\n");
-	    house = getdeviceaddr(&unit);
-	    dbprintf("house %d unit %d\n", house, unit);
-	    if (house < 0) return -1;
-	    if (unit < 0) {
-		/* Unit code is 0 but house code != 0 */
-		func = getfunc();
-		if (func < 0 || func == FUNC_EXTENDED_DIM) return -1;
-		if (func == FUNC_DIM || func == FUNC_BRIGHT) {
-		    param = getparam();
-		    if (param == -1) param = 1;
-		    pl_tx_housefunc(fd, house, func, param);
-		} else
-		    pl_tx_housefunc(fd, house, func, 0);
-	    } else {
-		func = getfunc();
-		if (func < 0) {
-		    pl_tx_houseunit(fd, house, unit);
-		    return -1;
-		}
-		dbprintf("func %d\n", func);
-		if (func == FUNC_EXTENDED_DIM) {
-		    param = getparam();
-		    if (param == -1) param = 1; /* default is 1 dim */
-		    pl_tx_extended_code_1(fd, house, unit, 3, 1, param);
-		} else if (func == FUNC_DIM || func == FUNC_BRIGHT) {
-		    param = getparam();
-		    if (param == -1) param = 1;
-		    pl_tx_houseunit(fd, house, unit);
-		    pl_tx_housefunc(fd, house, func, param);
-		} else if (func == FUNC_EXTENDED_CODE_1) {
-		    int command, subcmd, data;
-		    command = getparam();
-		    if (command == -1) command = 0;
-		    subcmd = getparam();
-		    if (subcmd == -1) subcmd = 0;
-		    data = getparam();
-		    if (data == -1) data = 0;
-		    pl_tx_extended_code_1(fd, house, unit, command, subcmd, data);
-		} else {
-		    pl_tx_houseunit(fd, house, unit);
-		    pl_tx_housefunc(fd, house, func, 0);
+	rc = parsecmd(command, &cmd, &arg1);
+	if ((rc > 0) && (ttl < 0)) {
+	    sockprintf(fd, "Invalid command %s\n", command);
+	    return -1;
+	}
+	if ((rc == 0) && (ttl < 0)) rc = -1;
+	cmd.ttlms = (ttl > 0) ? ttl : 0;
+	if (rc <= 0) {
+	    /* Transmit command */
+	    if (rc == 0) {
+		switch (x10cmd_admit(fd, &cmd, 1, &eta)) {
+		    case BATCH_EFULL:
+			statusprintf(fd, "busy\n");
+			return -1;
+		    case BATCH_EBUSY:
+			statusprintf(fd, "busy eta %d ms\n", eta);
+			return -1;
 		}
 	    }
-	} else if (strcmp(command, "RF") == 0) {
-	    printf("rf!\n");
-	    if (or20client(fd)) statusprintf(fd, "ok\n");
-	    printf("blah\n");
-	    house = getdeviceaddr(&unit);
-	    dbprintf("house %d unit %d\n", house, unit);
-	    if (house < 0) return -1;
-	    func = getfunc();
-	    dbprintf("house %d unit %d %d\n", house, unit, func);
-	    if (func < 0) return -1;
-	    printf("blah!\n");
-	    rf_tx_houseunitfunc(fd, house, unit, func);
-	} else if (strcmp(command, "RFSEC") == 0) {
-	    if (or20client(fd)) statusprintf(fd, "ok\n");
-	    rfaddr = 0;
-	    rf8bitaddr = getrfaddr(&rfaddr);
-	    dbprintf("rfaddr 8bit: %d %X\n", rf8bitaddr, rfaddr);
-	    if (rf8bitaddr < 0) return -1;
-	    func = getrffunc(rf8bitaddr);
-	    dbprintf("rf func %X\n", func);
-	    if (func < 0) return -1;
-	    rfsec_tx(fd, rf8bitaddr, rfaddr, func);
-	} else if (strcmp(command, "RFCAM") == 0) {
-	    if (or20client(fd)) statusprintf(fd, "ok\n");
-	    /* Unit number is ignored */
-	    house = getdeviceaddr(&unit);
-	    if (house < 0) return -1;
-	    arg1 = strtok(NULL, " ");
-	    if (arg1 == NULL || *arg1 == '\0') return -1;
-	    dbprintf("rfcam house keyname %d %s\n", house, arg1);
-
-	    rfcamkey = findCamRemoteCommand(arg1);
-	    if (rfcamkey > 0) {
-		house = x10housecoderf[house] << 4;
-		x10bytes8[0] = 0xeb;
-		x10bytes8[1] = 0x14;
-		x10bytes8[2] = (house + (rfcamkey - 0x2B)) & 0xFF;
-		x10bytes8[3] = rfcamkey;
-		x10bytes8[4] = house;
-		hexdump(x10bytes8, 5);
-		cm15a_decode_rf(-1, x10bytes8, 5);
-		if (Cm19a)
-		    x10_write(x10bytes8 + 1, 4);
-		else
-		    x10_write(x10bytes8, 5);
-	    } else {
-		sockprintf(fd, "Invalid command %s\n", arg1);
+	    /* Keep-alive panels get the error as their one reply instead */
+	    if (or20client(fd) && ((rc == 0) || (arg1 == NULL) ||
+			!keepaliveclient(fd)))
+		statusprintf(fd, "ok\n");
+	    if (rc < 0) {
+		if (arg1) sockprintf(fd, "Invalid command %s\n", arg1);
+		return -1;
 	    }
-	} else if (strcmp(command, "PT") == 0) {
-	    if (or20client(fd)) statusprintf(fd, "ok\n");
-	    len = gethexdata(x10bytes8);
-	    hexdump(x10bytes8, len);
-	    if (len > 0) x10_write(x10bytes8, len);
+	    x10cmd_exec(fd, &cmd);
+	    /* Unit code without function only selects the unit */
+	    if ((cmd.type == X10CMD_PL) && (cmd.func < 0)) return -1;
+	} else if (strcmp(command, "BATCH") == 0) {
+	    client_t *client = client_find(fd);
+
+	    if ((client == NULL) || client->batch) return -1;
+	    client->batch = calloc(BATCH_MAX, sizeof(x10cmd_t));
+	    if (client->batch == NULL) return -1;
 	}
 #if 0
 	    /* Enable/disable the internal RFTOPL repeater */
@@ -777,6 +1157,64 @@ int processcommandline(int fd, char *aLine) {
 		}
 	    } else
 		return -1;
+	} else if (strcmp(command, "NOTIFY") == 0) {
+	    client_t *client = client_find(fd);
+
+	    if (client == NULL) return -1;
+	    arg1 = strtok(NULL, " ");
+	    if (arg1 && (strcmp(arg1, "OFF") == 0))
+		client->opts &= ~CLIENTOPT_NOTIFY;
+	    else
+		client->opts |= CLIENTOPT_NOTIFY;
+	} else if (strcmp(command, "QUEUE") == 0) {
+	    if (queuecmd(fd) < 0) sockprintf(fd, "Invalid command\n");
+	} else if (strcmp(command, "STATS") == 0) {
+	    x10_stats(fd);
+	    usbio_stats(fd);
+	    rfmerge_stats(fd);
+	} else if (strcmp(command, "KEEPALIVE") == 0) {
+	    client_t *client = client_find(fd);
+
+	    /* OpenRemote panels that send this first keep the connection open
+	     * for any number of commands. Others are closed after one.
+	     */
+	    if ((client == NULL) || (client->type != CLIENT_OR20)) return -1;
+	    client->opts &= ~CLIENTOPT_ONESHOT;
+	    client->opts |= CLIENTOPT_KEEPALIVE;
+	} else if (strcmp(command, "RESUME") == 0) {
+	    client_t *client = client_find(fd);
+	    char *endp;
+	    uint32_t seq;
+
+	    if ((client == NULL) || (client->type == CLIENT_OR20) ||
+		    (client->type == CLIENT_AMQP))
+		return -1;
+	    arg1 = strtok(NULL, " ");
+	    if (arg1) {
+		seq = strtoul(arg1, &endp, 10);
+		if (*endp) return -1;
+	    }
+	    else
+		seq = replay_last();
+	    /* Number events so the client knows where to resume next time */
+	    if (client->framing == FRAME_PLAIN)
+		client->framing = FRAME_SEQ;
+	    client_resume(client, seq);
+	} else if (strcmp(command, "SUBSCRIBE") == 0) {
+	    evfilter_t filter;
+	    client_t *client = client_find(fd);
+
+	    if (client == NULL) return -1;
+	    arg1 = strtok(NULL, "");
+	    if (arg1 == NULL) evfilter_all(&filter);
+	    else if (evfilter_parse(&filter, arg1) < 0) {
+		sockprintf(fd, "Invalid subscribe\n");
+		return -1;
+	    }
+	    client_subscribe(client, &filter);
+	    sockprintf(fd, "Subscribe houses %04X classes %02X dirs %X sec %d %s\n",
+		    filter.houses, filter.classes & 0xFF, filter.dirs,
+		    filter.nsec, (filter.noecho) ? "noecho" : "echo");
 	} else if (strcmp(command, "GETSTATUSSEC") == 0) {
 	    rfaddr = 0;
 	    rf8bitaddr = getrfaddr(&rfaddr);
@@ -794,34 +1232,62 @@ int processcommandline(int fd, char *aLine) {
 /*
  * Parse human readable commands and convert to binary X10 protocol.
  * Send to CM15A.
+ * Every complete line in the client input buffer is processed so pipelined
+ * commands all run from one read. A partial line is left at the front of the
+ * buffer for the next read. Each client has its own buffer so partial lines
+ * from different connections never mix.
  */
-void cm15a_encode(int fd, unsigned char * buf, size_t buflen) {
-    static char remainder[80]; // Any leftover, not seen \n yet.
-    static size_t remlen = 0;
-    char *remptr;
-
-    dbprintf("buflen %lu\n", (unsigned long) buflen);
-    hexdump(buf, buflen);
-    dbprintf("remlen %lu\n", (unsigned long) remlen);
-    hexdump(remainder, remlen);
-
-    /* Break the input stream into \n or \r terminated lines. The stream is not
-     * guaranteed to end on a line boundary so there may be left over input
-     * which must be processed the next time around.
-     */
-    remptr = remainder + remlen;
-    while (buflen--) {
-	*remptr = *buf;
-	if ((*remptr == '\n') || (*remptr == '\r') || (*remptr == '\0')) {
-	    *remptr = '\0';
-	    if (strlen(remainder)) {
-		processcommandline(fd, remainder);
-		if (or20client(fd)) del_client(fd);
+void cm15a_encode(client_t *client) {
+    char *line, *end, *p;
+    int fd = client->src.fd;
+
+    dbprintf("inlen %lu\n", (unsigned long) client->inlen);
+    line = client->inbuf;
+    end = client->inbuf + client->inlen;
+    for (p = line; p < end; p++) {
+	if ((*p != '\n') && (*p != '\r') && (*p != '\0')) continue;
+	*p = '\0';
+	if (client->inskip) {
+	    /* End of a line that did not fit */
+	    client->inskip = 0;
+	}
+	else if (*line) {
+	    /* Output queue full, keep this line and the rest for later */
+	    if (client_hold(client, line_sends(client, line))) break;
+	    client->replied = 0;
+	    client->inputline = 1;
+	    if (client->batch)
+		batch_line(client, line);
+	    else
+		processcommandline(fd, line);
+	    /* Processing may have closed the client */
+	    if (client->src.fd < 0) return;
+	    client->inputline = 0;
+	    /* Pipelined OpenRemote clients match replies to commands by
+	     * counting so every line gets exactly one.
+	     */
+	    if ((client->opts & CLIENTOPT_KEEPALIVE) && !client->replied)
+		statusprintf(fd, "ok\n");
+	    /* A one shot client may send one whole batch */
+	    if ((client->opts & CLIENTOPT_ONESHOT) && !client->batch) {
+		client_close(client);
+		client->inlen = 0;
+		return;
 	    }
-	    remptr = remainder;
-	} else
-	    remptr++;
-	buf++;
+	}
+	line = p + 1;
+    }
+
+    client->inlen = end - line;
+    if (!client->held && (client->inlen == sizeof(client->inbuf))) {
+	/* No line terminator in a full buffer. Throw it away and skip to the
+	 * next line terminator.
+	 */
+	syslog(LOG_NOTICE, "client %d command line too long", fd);
+	client->inskip = 1;
+	client->inlen = 0;
+    }
+    else if (client->inlen && (line != client->inbuf)) {
+	memmove(client->inbuf, line, client->inlen);
     }
-    remlen = remptr - remainder;
 }
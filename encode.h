@@ -17,7 +17,55 @@
  * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
+#include "client.h"
+
+typedef enum x10cmdtype {
+    X10CMD_PL = 1,
+    X10CMD_RF,
+    X10CMD_RFSEC,
+    X10CMD_RFCAM,
+    X10CMD_PT,
+} x10cmdtype_t;
+
+/* One transmit command. Filled in from a text command line by
+ * processcommandline() or from a binary command record by binproto.c.
+ */
+typedef struct x10cmd {
+    x10cmdtype_t type;
+    int house;                  /* 0..15 for A..P */
+    int unit;                   /* 0..15 for 1..16, -1 for none */
+    int func;                   /* FUNC_*, -1 for address only. RFSEC
+                                   function or RFCAM key code. */
+    int param[3];               /* Dims, or extended code command, subcmd,
+                                   data */
+    int rf8bitaddr;             /* RFSEC: 1 for 8 bit address */
+    unsigned long rfaddr;       /* RFSEC address */
+    size_t len;                 /* PT: number of bytes */
+    unsigned char bytes[8];     /* PT: bytes sent as is */
+    uint32_t ttlms;             /* Dropped if not started in time, 0 for
+                                   no limit */
+} x10cmd_t;
+
+/* Most commands in one BATCH */
+#define BATCH_MAX       (64)
+
+/* x10cmd_batch() return */
+#define BATCH_OK        (0)
+#define BATCH_EINVAL    (-1)
+#define BATCH_EFULL     (-2)
+#define BATCH_EBUSY     (-3)    /* Estimated wait over --max-latency */
+
+int x10cmd_check(const x10cmd_t *cmd);
+
+int x10cmd_admit(int fd, const x10cmd_t *cmds, int n, int *etams);
+
+int x10cmd_batch(int fd, const x10cmd_t *cmds, int n, uint32_t *ids,
+        int *bad, int *etams);
+
+uint32_t x10cmd_exec(int fd, const x10cmd_t *cmd);
+
 int processcommandline(int fd, char *aLine);
 
-void cm15a_encode(int fd, unsigned char * buf, size_t buflen);
+void cm15a_encode(client_t *client);
 
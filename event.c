@@ -0,0 +1,202 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* X10 event records */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "global.h"
+#include "event.h"
+
+/* Sequence number of the last event sent */
+static uint32_t Eventseq = 0;
+
+/* Client whose command is being sent, see x10cmd_exec() */
+static int Origin = -1;
+
+void event_init(x10event_t *ev, int dir, evclass_t evclass,
+        const unsigned char *raw, size_t rawlen)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->dir = dir;
+    ev->evclass = evclass;
+    ev->house = EV_NOHOUSE;
+    ev->func = EV_NOFUNC;
+    ev->origin = (dir == EV_TX) ? Origin : -1;
+    if (rawlen > sizeof(ev->raw)) rawlen = sizeof(ev->raw);
+    ev->rawlen = rawlen;
+    memcpy(ev->raw, raw, rawlen);
+}
+
+/* Give the event the next sequence number and the current time */
+void event_stamp(x10event_t *ev)
+{
+    ev->seq = ++Eventseq;
+    ev->monous = monotonic_us();
+    ev->wallus = realtime_us();
+}
+
+/* TX events created until the next call are marked as caused by fd */
+void event_set_origin(int fd)
+{
+    Origin = fd;
+}
+
+/* Let everything through */
+void evfilter_all(evfilter_t *f)
+{
+    int i;
+
+    memset(f, 0, sizeof(*f));
+    f->classes = ~0U;
+    f->dirs = (1 << EV_RX) | (1 << EV_TX);
+    f->houses = 0xFFFF;
+    for (i = 0; i < 16; i++) f->units[i] = 0xFFFF;
+}
+
+/* Parse a space separated SUBSCRIBE list into f.
+ *   ALL                     everything
+ *   PL RF RFSEC RFCAM RAW   event classes
+ *   RX TX                   direction
+ *   A A1 A1-8               house code, unit code, range of unit codes
+ *   0x11 C6:1B:00           RF security address, 8 or 24 bits
+ *   NOECHO ECHO             skip or include TX events this client sent
+ * A group that is not mentioned allows everything.
+ * Returns 0, or -1 if a token is invalid in which case f is not changed.
+ */
+int evfilter_parse(evfilter_t *f, char *spec)
+{
+    evfilter_t nf;
+    char *tok, *p, *save;
+    unsigned int a1, a2, a3;
+    int classes = 0, dirs = 0, houses = 0;
+    int house, ufirst, ulast, i;
+
+    memset(&nf, 0, sizeof(nf));
+    for (tok = strtok_r(spec, " ", &save); tok;
+            tok = strtok_r(NULL, " ", &save)) {
+        for (p = tok; *p; p++) *p = toupper((unsigned char)*p);
+        if ((strcmp(tok, "ALL") == 0) || (strcmp(tok, "*") == 0)) {
+            classes = dirs = houses = 1;
+            nf.classes = ~0U;
+            nf.dirs = (1 << EV_RX) | (1 << EV_TX);
+            nf.houses = 0xFFFF;
+            for (i = 0; i < 16; i++) nf.units[i] = 0xFFFF;
+            nf.nsec = 0;
+        }
+        else if (strcmp(tok, "PL") == 0) {
+            classes = 1;
+            nf.classes |= 1 << EV_PL;
+        }
+        else if (strcmp(tok, "RF") == 0) {
+            classes = 1;
+            nf.classes |= 1 << EV_RF;
+        }
+        else if (strcmp(tok, "RFSEC") == 0) {
+            classes = 1;
+            nf.classes |= 1 << EV_RFSEC;
+        }
+        else if (strcmp(tok, "RFCAM") == 0) {
+            classes = 1;
+            nf.classes |= 1 << EV_RFCAM;
+        }
+        else if (strcmp(tok, "RAW") == 0) {
+            classes = 1;
+            nf.classes |= 1 << EV_RAW;
+        }
+        else if (strcmp(tok, "RX") == 0) {
+            dirs = 1;
+            nf.dirs |= 1 << EV_RX;
+        }
+        else if (strcmp(tok, "TX") == 0) {
+            dirs = 1;
+            nf.dirs |= 1 << EV_TX;
+        }
+        else if (strcmp(tok, "NOECHO") == 0) {
+            nf.noecho = 1;
+        }
+        else if (strcmp(tok, "ECHO") == 0) {
+            nf.noecho = 0;
+        }
+        else if (strchr(tok, ':')) {
+            if ((sscanf(tok, "%2x:%2x:%2x", &a1, &a2, &a3) != 3) ||
+                    (nf.nsec >= EVFILTER_MAXSEC))
+                return -1;
+            nf.sec[nf.nsec++] = (a1 << 16) | (a2 << 8) | a3;
+        }
+        else if ((tok[0] == '0') && (tok[1] == 'X')) {
+            a1 = strtoul(tok + 2, &p, 16);
+            if (*p || (a1 > 0xFF) || (nf.nsec >= EVFILTER_MAXSEC)) return -1;
+            nf.sec[nf.nsec++] = a1 | EVFILTER_SEC8;
+        }
+        else if ((tok[0] >= 'A') && (tok[0] <= 'P')) {
+            house = tok[0] - 'A';
+            houses = 1;
+            nf.houses |= 1 << house;
+            if (tok[1] == '\0') {
+                nf.units[house] = 0xFFFF;
+                continue;
+            }
+            ufirst = strtol(tok + 1, &p, 10);
+            ulast = ufirst;
+            if (*p == '-') ulast = strtol(p + 1, &p, 10);
+            if (*p || (ufirst < 1) || (ulast > 16) || (ufirst > ulast))
+                return -1;
+            for (i = ufirst; i <= ulast; i++)
+                nf.units[house] |= 1 << (i - 1);
+        }
+        else {
+            return -1;
+        }
+    }
+    if (!classes) nf.classes = ~0U;
+    if (!dirs) nf.dirs = (1 << EV_RX) | (1 << EV_TX);
+    if (!houses) {
+        nf.houses = 0xFFFF;
+        for (i = 0; i < 16; i++) nf.units[i] = 0xFFFF;
+    }
+    *f = nf;
+    return 0;
+}
+
+/* Return 1 if the client on fd with filter f wants ev */
+int evfilter_match(const evfilter_t *f, const x10event_t *ev, int fd)
+{
+    uint32_t key;
+    int i;
+
+    if (!(f->classes & (1U << ev->evclass))) return 0;
+    if (!(f->dirs & (1U << ev->dir))) return 0;
+    if (f->noecho && (ev->origin == fd) && (ev->dir == EV_TX)) return 0;
+    if (ev->house != EV_NOHOUSE) {
+        if (!(f->houses & (1 << ev->house))) return 0;
+        /* House code only events such as "A On" go to every unit */
+        if (ev->unit && !(f->units[ev->house] & (1 << (ev->unit - 1))))
+            return 0;
+    }
+    if ((ev->evclass == EV_RFSEC) && f->nsec) {
+        key = ev->secaddr | ((ev->flags & EVF_SEC8) ? EVFILTER_SEC8 : 0);
+        for (i = 0; i < f->nsec; i++)
+            if (f->sec[i] == key) return 1;
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* X10 events in structured form. Decoders fill in an x10event_t next to the
+ * text line so clients that do not want text (see binproto.c) get the same
+ * information without parsing.
+ */
+
+/* Direction */
+#define EV_RX           (0)
+#define EV_TX           (1)
+
+/* Event class */
+typedef enum evclass {
+    EV_PL = 1,              /* Power line */
+    EV_RF,                  /* Standard X10 RF */
+    EV_RFSEC,               /* X10 RF security */
+    EV_RFCAM,               /* X10 RF camera */
+    EV_RAW,                 /* Raw frame from the controller */
+    EV_NCLASSES
+} evclass_t;
+
+#define EV_NOHOUSE      (0xFF)  /* house when there is no house code */
+#define EV_NOFUNC       (0xFF)  /* func for address only PL events */
+
+/* flags */
+#define EVF_SEC8        (0x01)  /* secaddr is an 8 bit RF security address */
+
+typedef struct x10event {
+    uint32_t seq;               /* Set when the event is sent */
+    uint64_t monous;            /* Monotonic time, microseconds */
+    uint64_t wallus;            /* Wall clock time, microseconds */
+    unsigned char dir;          /* EV_RX or EV_TX */
+    unsigned char evclass;      /* evclass_t */
+    unsigned char house;        /* 0..15 for A..P */
+    unsigned char unit;         /* 1..16, 0 if no unit code */
+    unsigned char func;         /* FUNC_* for PL and RF, else key code */
+    unsigned char data;         /* Dims or extended code data */
+    unsigned char data2;        /* Extended code command */
+    unsigned char flags;        /* EVF_* */
+    uint32_t secaddr;           /* RF security address */
+    unsigned char rawlen;
+    unsigned char raw[8];       /* Frame as decoded */
+    int origin;                 /* fd of the client that sent it, or -1 */
+} x10event_t;
+
+#define EVFILTER_MAXSEC (16)
+#define EVFILTER_SEC8   (0x1000000)     /* Marks 8 bit security addresses */
+
+/* Which events a client wants. Built once by SUBSCRIBE so checking an event
+ * is a few bit tests.
+ */
+typedef struct evfilter {
+    unsigned int classes;       /* 1 << evclass */
+    unsigned int dirs;          /* 1 << EV_RX, 1 << EV_TX */
+    uint16_t houses;            /* 1 << house */
+    uint16_t units[16];         /* Per house, 1 << (unit - 1) */
+    int nsec;                   /* Number of sec[], 0 for all */
+    uint32_t sec[EVFILTER_MAXSEC];  /* RF security address | EVFILTER_SEC8 */
+    int noecho;                 /* Skip TX events the client caused */
+} evfilter_t;
+
+void event_init(x10event_t *ev, int dir, evclass_t evclass,
+        const unsigned char *raw, size_t rawlen);
+
+void event_stamp(x10event_t *ev);
+
+void event_set_origin(int fd);
+
+void evfilter_all(evfilter_t *f);
+
+int evfilter_parse(evfilter_t *f, char *spec);
+
+int evfilter_match(const evfilter_t *f, const x10event_t *ev, int fd);
+
+int evprintf(int fd, x10event_t *ev, const char *fmt, ...);
+
+#endif
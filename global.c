@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 #include "global.h"
 
 int Cm19a = 0;
@@ -46,3 +47,21 @@ int _dbprintf(const char *fmt, ...)
     va_end(args);
     return fprintf(stderr, "%s", buf);
 }
+
+/* Monotonic time in microseconds. Use for intervals. */
+uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Wall clock time in microseconds since 1970 */
+uint64_t realtime_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
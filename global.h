@@ -17,13 +17,18 @@
  * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
+
 struct SecEventRec {
     unsigned char funct;
     const char *name;
 };
 
+/* 1 if no controller can send PL, only CM19As were found */
 int Cm19a;
-int PollTimeOut;
+
+/* Most CM15A/CM19A controllers opened at once */
+#define CTLR_MAX    (4)
 
 /* 1 bit per house code, 1=RF to PL, 0=off, default all house codes on */
 unsigned short RfToPl16;
@@ -34,7 +39,7 @@ unsigned short RfToRf16;
 #define dbprintf(fmt, ...) _dbprintf(fmt, __FILE__,__LINE__, ## __VA_ARGS__)
 int _dbprintf(const char *fmt, ...);
 
-int write_usb(unsigned char *buf, size_t len);
+int write_usb(int ctlr, unsigned char *buf, size_t len);
 
 int statusprintf(int fd, const char *fmt, ...);
 int sockprintf(int fd, const char *fmt, ...);
@@ -49,4 +54,8 @@ int or20client(int fd);
 
 int del_client(int fd);
 
+uint64_t monotonic_us(void);
+
+uint64_t realtime_us(void);
+
 
@@ -0,0 +1,292 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE             /* memmem() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include "global.h"
+#include "http.h"
+#include "x10state.h"
+
+/* Largest /state response body */
+#define HTTP_STATE_MAX  (64*1024)
+
+/* /state response, kept until hua_version() changes */
+static msgbuf_t *Statehead = NULL;
+static msgbuf_t *Statebody = NULL;
+static unsigned long Stateversion;
+
+/* Header endings, shared by every response */
+static msgbuf_t *Endkeep = NULL;
+static msgbuf_t *Endkeep10 = NULL;  /* HTTP/1.0 must be told */
+static msgbuf_t *Endclose = NULL;
+
+/* One SSE message per event. Event lines never contain a newline except
+ * the one at the end, which is dropped.
+ */
+msgbuf_t *http_sse_event(const x10event_t *ev, const msgbuf_t *plain)
+{
+    char buf[1024];
+    size_t textlen = plain->len;
+    int len;
+
+    if (textlen && (plain->data[textlen-1] == '\n')) textlen--;
+    len = snprintf(buf, sizeof(buf), "id: %u\ndata: %.*s\n\n", ev->seq,
+            (int)textlen, plain->data);
+    if (len < 0) return NULL;
+    if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+    return msgbuf_new(buf, len);
+}
+
+/* Events after seq up to but not including next were lost */
+msgbuf_t *http_sse_gap(uint32_t seq, uint32_t next)
+{
+    char buf[64];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "event: gap\ndata: %u %u\n\n", seq, next);
+    return msgbuf_new(buf, len);
+}
+
+/* Queue shared msgbufs. Returns -1 if the client was deleted. */
+static int http_queue(client_t *client, msgbuf_t *msg)
+{
+    if (msg == NULL) return 0;
+    return client_queue(client, msg);
+}
+
+static int http_static(msgbuf_t **msg, const char *text)
+{
+    if (*msg == NULL) *msg = msgbuf_new(text, strlen(text));
+    return (*msg) ? 0 : -1;
+}
+
+/* Render /state again if the state has changed since last time */
+static int http_state_render(void)
+{
+    char *body;
+    char head[128];
+    size_t len;
+    int headlen;
+
+    if (Statebody && (Stateversion == hua_version())) return 0;
+    body = malloc(HTTP_STATE_MAX);
+    if (body == NULL) return -1;
+    len = hua_json(body, HTTP_STATE_MAX);
+    if (len >= HTTP_STATE_MAX) {
+        syslog(LOG_ERR, "http /state larger than %d bytes", HTTP_STATE_MAX);
+        free(body);
+        return -1;
+    }
+    headlen = snprintf(head, sizeof(head),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: application/json\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Content-Length: %lu\r\n", (unsigned long)len);
+    msgbuf_unref(Statehead);
+    msgbuf_unref(Statebody);
+    Statehead = msgbuf_new(head, headlen);
+    Statebody = msgbuf_new(body, len);
+    free(body);
+    if ((Statehead == NULL) || (Statebody == NULL)) {
+        msgbuf_unref(Statehead);
+        msgbuf_unref(Statebody);
+        Statehead = Statebody = NULL;
+        return -1;
+    }
+    Stateversion = hua_version();
+    return 0;
+}
+
+/* Connection header for a response. HTTP/1.1 keeps the connection by
+ * default, HTTP/1.0 closes it unless told otherwise.
+ */
+static const char *http_connection(int keepalive, int http10)
+{
+    if (!keepalive) return "Connection: close\r\n";
+    return (http10) ? "Connection: keep-alive\r\n" : "";
+}
+
+/* Send a response with no body, or a short text body */
+static int http_error(client_t *client, const char *status, const char *conn)
+{
+    char buf[256];
+    int len;
+
+    len = snprintf(buf, sizeof(buf),
+            "HTTP/1.1 %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %lu\r\n"
+            "%s"
+            "\r\n"
+            "%s\n",
+            status, (unsigned long)strlen(status) + 1, conn, status);
+    return client_write(client, buf, len);
+}
+
+/* Handle one request. Returns 1 to keep the connection, 0 to close it once
+ * the response is sent, or -1 if the client was deleted.
+ */
+static int http_request(client_t *client, char *req)
+{
+    char *line, *next, *method, *path, *version, *value;
+    const char *conn;
+    int keepalive, http10, haveid = 0, body = 0, chunked = 0;
+    unsigned long lastid = 0;
+
+    next = strchr(req, '\n');
+    if (next) *next++ = '\0';
+    method = strtok(req, " \r");
+    path = strtok(NULL, " \r");
+    version = strtok(NULL, " \r");
+    if ((method == NULL) || (path == NULL) || (version == NULL) ||
+            (strncmp(version, "HTTP/1.", 7) != 0)) {
+        if (http_error(client, "400 Bad Request", http_connection(0, 0)) < 0)
+            return -1;
+        return 0;
+    }
+    http10 = (strcmp(version, "HTTP/1.0") == 0);
+    keepalive = !http10;
+
+    /* Only the headers that matter here */
+    while ((line = next) != NULL) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        value = strchr(line, ':');
+        if (value == NULL) continue;
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        value[strcspn(value, "\r")] = '\0';
+        if (strcasecmp(line, "Connection") == 0) {
+            if (strcasecmp(value, "close") == 0)
+                keepalive = 0;
+            else if (strcasecmp(value, "keep-alive") == 0)
+                keepalive = 1;
+        }
+        else if (strcasecmp(line, "Last-Event-ID") == 0) {
+            lastid = strtoul(value, NULL, 10);
+            haveid = 1;
+        }
+        else if (strcasecmp(line, "Content-Length") == 0) {
+            if ((*value == '\0') || (strspn(value, "0") != strlen(value)))
+                body = 1;
+        }
+        else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            chunked = 1;
+        }
+    }
+    dbprintf("http %d %s %s\n", client->src.fd, method, path);
+
+    /* Nothing here takes a body. Rather than read one it would be taken
+     * for the next request so refuse it and close the connection.
+     */
+    if (chunked || body) {
+        if (http_error(client, (chunked) ? "411 Length Required" :
+                    "400 Bad Request", http_connection(0, 0)) < 0)
+            return -1;
+        return 0;
+    }
+    conn = http_connection(keepalive, http10);
+
+    if (strcmp(method, "GET") != 0) {
+        if (http_error(client, "405 Method Not Allowed", conn) < 0)
+            return -1;
+        return keepalive;
+    }
+    path[strcspn(path, "?")] = '\0';
+    if (strcmp(path, "/state") == 0) {
+        if ((http_state_render() < 0) ||
+                (http_static(&Endkeep, "\r\n") < 0) ||
+                (http_static(&Endkeep10,
+                             "Connection: keep-alive\r\n\r\n") < 0) ||
+                (http_static(&Endclose, "Connection: close\r\n\r\n") < 0)) {
+            if (http_error(client, "503 Service Unavailable", conn) < 0)
+                return -1;
+            return keepalive;
+        }
+        if ((http_queue(client, Statehead) < 0) ||
+                (http_queue(client, (!keepalive) ? Endclose :
+                            (http10) ? Endkeep10 : Endkeep) < 0) ||
+                (http_queue(client, Statebody) < 0))
+            return -1;
+        return keepalive;
+    }
+    if (strcmp(path, "/events") == 0) {
+        static const char head[] =
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/event-stream\r\n"
+            "Cache-Control: no-cache\r\n"
+            "\r\n";
+        evfilter_t filter;
+
+        if (client_write(client, head, sizeof(head) - 1) < 0) return -1;
+        /* Events from now on. Further input is ignored. */
+        client->opts |= CLIENTOPT_STREAM;
+        evfilter_all(&filter);
+        filter.classes &= ~(1U << EV_RAW);
+        client_subscribe(client, &filter);
+        if (haveid) client_resume(client, lastid);
+        return 1;
+    }
+    if (http_error(client, "404 Not Found", conn) < 0) return -1;
+    return keepalive;
+}
+
+/* Handle every complete request in the client input buffer */
+void http_input(client_t *client)
+{
+    char *end, *req = client->inbuf;
+    size_t left = client->inlen;
+    size_t reqlen;
+    int rc;
+
+    while (left && !(client->opts & CLIENTOPT_STREAM)) {
+        end = memmem(req, left, "\r\n\r\n", 4);
+        if (end) {
+            reqlen = end - req + 4;
+        }
+        else {
+            end = memmem(req, left, "\n\n", 2);
+            if (end == NULL) break;
+            reqlen = end - req + 2;
+        }
+        *end = '\0';
+        rc = http_request(client, req);
+        if (rc < 0) return;
+        if (rc == 0) {
+            client_close(client);
+            return;
+        }
+        req += reqlen;
+        left -= reqlen;
+    }
+    if (client->opts & CLIENTOPT_STREAM) left = 0;
+    if (left == sizeof(client->inbuf)) {
+        /* No end of headers and no room to wait for it */
+        if (http_error(client, "431 Request Header Fields Too Large",
+                    http_connection(0, 0)) >= 0)
+            client_close(client);
+        return;
+    }
+    if (left && (req != client->inbuf)) memmove(client->inbuf, req, left);
+    client->inlen = left;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "client.h"
+#include "event.h"
+
+/* Small HTTP/1.1 server on SERVER_PORT+4 (1103)
+ *
+ *   GET /state     Device and security sensor state as JSON. The response
+ *                  is rendered only when the state changes.
+ *   GET /events    Server-Sent Events. Each X10 event is sent as
+ *                  "id: <seq>" and "data: <text line>". A Last-Event-ID
+ *                  header resumes after that event, see RESUME.
+ *
+ * Connections are kept alive unless the client asks otherwise. Requests
+ * may be pipelined.
+ */
+
+msgbuf_t *http_sse_event(const x10event_t *ev, const msgbuf_t *plain);
+
+msgbuf_t *http_sse_gap(uint32_t seq, uint32_t next);
+
+void http_input(client_t *client);
+
+#endif
@@ -34,7 +34,6 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <signal.h>
-#include <poll.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
@@ -51,31 +50,30 @@
 #include <netinet/in.h>
 
 #include "global.h"
+#include "sensorflare.h"
 
 #define SERVER_PORT     (1099)
-#define MAXCLISOCKETS   (32)
-#define MAXSOCKETS      (1+MAXCLISOCKETS)
-                            /* first socket=listen socket, 20 client sockets */
-#define USB_FDS         (10)    /* libusb file descriptors */
-static struct pollfd Clients[(3*MAXSOCKETS)+USB_FDS];
-/* Client sockets */
-static struct pollfd Clientsocks[MAXCLISOCKETS];
-static struct pollfd Clientxmlsocks[MAXCLISOCKETS];
-static struct pollfd Clientor20socks[MAXCLISOCKETS];
-static size_t NClients;     /* # of valid entries in Clientsocks */
-static size_t NxmlClients;  /* # of valid entries in Clientxmlsocks */
-static size_t Nor20Clients; /* # of valid entries in Clientor20socks */
+
+#include "reactor.h"
+#include "client.h"
+#include "event.h"
+#include "replay.h"
+#include "usbio.h"
 
 /**** USB usblib 1.0 ****/
 
 #include <libusb-1.0/libusb.h>
-uint8_t InEndpoint, OutEndpoint;
 
-static struct libusb_device_handle *Devh = NULL;
-static struct libusb_transfer *IntrOut_transfer = NULL;
-static struct libusb_transfer *IntrIn_transfer = NULL;
-static unsigned char IntrOutBuf[8];
-static unsigned char IntrInBuf[8];
+/* An opened CM15A or CM19A */
+typedef struct controller {
+    libusb_device_handle *devh;
+    uint8_t inendpt, outendpt;
+    int cm19a;
+    int reattach;               /* Kernel driver was detached */
+} controller_t;
+
+static controller_t Controllers[CTLR_MAX];
+static int Ncontrollers = 0;
 
 /*
  * Like printf but print to socket without date/time stamp.
@@ -86,119 +84,157 @@ int statusprintf(int fd, const char *fmt, ...)
     va_list args;
     char buf[1024];
     int buflen;
+    client_t *client;
+
+    client = client_find(fd);
+    if (client) {
+        /* Keep-alive OpenRemote clients get one reply per line */
+        if ((client->opts & CLIENTOPT_KEEPALIVE) && client->replied)
+            return 0;
+        client->replied = 1;
+    }
 
     va_start(args,fmt);
     buflen = vsnprintf(buf, sizeof(buf)-2, fmt, args);
     va_end(args);
-    return send(fd, buf, buflen, MSG_NOSIGNAL);
+    return client_send(fd, buf, buflen);
 }
 
-static int xmlclient(int fd)
+/* Return 0 if the socket fd is not an OpenRemote 2.0 client.
+ * Else return 1. OR clients connect to SERVER_PORT+2 (1101). The client type
+ * is set when the connection is accepted.
+ */
+int or20client(int fd)
 {
-    int i;
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if (fd == Clientxmlsocks[i].fd) return 1;
+    client_t *client = client_find(fd);
+
+    return (client && (client->type == CLIENT_OR20));
+}
+
+// This affects whether decode.c will show raw frame data for debugging RF connectivity
+// as well as providing raw data for parsing by users like misterhouse's X10_CMxx module.
+int raw_data = 0;
+
+/* Copy the "MM/DD HH:MM:SS " prefix into buf. Events come in bursts within
+ * the same second so the prefix is only reformatted when the second changes.
+ */
+static int timestamp(char *buf)
+{
+    static time_t Stamptime = (time_t)-1;
+    static char Stamp[32];
+    static int Stamplen;
+    time_t tm;
+
+    tm = time(NULL);
+    if (tm != Stamptime) {
+        Stamplen = strftime(Stamp, sizeof(Stamp), "%m/%d %T ", localtime(&tm));
+        Stamptime = tm;
     }
-    return 0;
+    memcpy(buf, Stamp, Stamplen);
+    return Stamplen;
 }
 
-/* Return 0 if the socket fd is not an OpenRemote 2.0 client.
- * Else return 1. OR clients connect to SERVER_PORT+2 (1101)  so that is
- * used.
- *
+/* Format once and send. ev, if not NULL, is the same event in structured
+ * form for binary clients.
  */
-int or20client(int fd)
+static int vsockprintf(int fd, x10event_t *ev, const char *fmt, va_list args)
 {
-    struct sockaddr_in locl;
-    socklen_t locllen;
+    char buf[1024];
+    int len, buflen;
+    bcast_t bcast;
+    client_t *client;
 
-    locllen = sizeof(locl);
-    if (getsockname(fd, (struct sockaddr *)&locl, &locllen) < 0) {
-        dbprintf("getsockname -1/%d\n", errno);
-        return 0;
+    len = timestamp(buf);
+    buflen = vsnprintf(buf+len, sizeof(buf)-len, fmt, args);
+    if (buflen < 0) return -1;
+    buflen += len;
+    if (buflen >= sizeof(buf)) buflen = sizeof(buf) - 1;
+
+    if (fd != -1) {
+        client = client_find(fd);
+        if (client == NULL) return -1;
+        /* Keep-alive OpenRemote clients read exactly one status reply per
+         * command line. The first reply to a line is it, without the time
+         * stamp. Anything more, or sent between lines, would be taken as
+         * the next reply.
+         */
+        if (client->opts & CLIENTOPT_KEEPALIVE) {
+            if (!client->inputline || client->replied) return 0;
+            client->replied = 1;
+            return client_write(client, buf + len, buflen - len);
+        }
+        if (client->framing == FRAME_PLAIN)
+            return client_write(client, buf, buflen);
+    }
+    else {
+        /* Send to sensorflare client. Raw frames only with --raw-data. */
+        if ((ev == NULL) || (ev->evclass != EV_RAW) || raw_data)
+            sendMessage(buf);
+        client = NULL;
+        if (ev) {
+            event_stamp(ev);
+            replay_add(ev, buf, buflen);
+        }
     }
-    dbprintf("locl port %d\n", ntohs(locl.sin_port));
-    return (ntohs(locl.sin_port) == (SERVER_PORT + 2));
+
+    memset(&bcast, 0, sizeof(bcast));
+    bcast.ev = ev;
+    bcast.frame[FRAME_PLAIN] = msgbuf_new(buf, buflen);
+    if (bcast.frame[FRAME_PLAIN] == NULL) return -1;
+    if (client)
+        client_queue(client, bcast_frame(&bcast, client->framing));
+    else
+        client_broadcast(&bcast);
+    bcast_release(&bcast);
+    return buflen;
 }
 
 /*
  * Like printf but prefix each line with date/time stamp.
  * If fd == -1, send to all socket clients else send only to fd.
+ * The line is formatted once. Each client framing (plain, xml) is rendered
+ * at most once and the same buffer is queued on every client.
  */
 int sockprintf(int fd, const char *fmt, ...)
 {
     va_list args;
-    char buf[1024];
-    char *aLine;
-    int len, buflen;
-    time_t tm;
-    int i;
-    int bytesOut;
+    int rc;
 
-    aLine = buf;
-    tm = time(NULL);
-    len = strftime(aLine, sizeof(buf), "%m/%d %T ", localtime(&tm));
-    
     va_start(args,fmt);
-    buflen = vsnprintf(aLine+len, sizeof(buf)-len, fmt, args);
+    rc = vsockprintf(fd, NULL, fmt, args);
     va_end(args);
-    buflen += len;
-    if (fd != -1) {
-        if (xmlclient(fd) && (aLine[buflen-1] == '\n')) {
-            aLine[buflen-1] = '\0';
-        }
-        return send(fd, aLine, buflen, MSG_NOSIGNAL);
-    }
+    return rc;
+}
 
-    /* Send to sensorflare client */
-    sendMessage(aLine);
-    
-    /* Send to all socket clients */
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if ((fd = Clientsocks[i].fd) > 0) {
-            dbprintf("%s i %d fd %d\n", __func__, i, fd);
-            bytesOut = send(fd, aLine, buflen, MSG_NOSIGNAL);
-            dbprintf("bytesOut %d\n", bytesOut);
-            if (bytesOut != buflen)
-                dbprintf("%s: %d/%d\n", __func__, bytesOut, errno);
-        }
-    }
-    /* Replace trialing newline with NUL if present. 
-     * This assumes newline only at end of buffer.
-     */
-    if (aLine[buflen-1] == '\n') {
-        aLine[buflen-1] = '\0';
-    }
-    
-    /* Send to all xml socket clients */
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if ((fd = Clientxmlsocks[i].fd) > 0) {
-            dbprintf("%s i %d fd %d\n", __func__, i, fd);
-            /* NOTE: Send xml including trailing NUL '\0' */
-            bytesOut = send(fd, aLine, buflen, MSG_NOSIGNAL);
-            dbprintf("bytesOut %d\n", bytesOut);
-            if (bytesOut != buflen)
-                dbprintf("%s: %d/%d\n", __func__, bytesOut, errno);
-        }
-    }
-    
-    return buflen;
+/* Like sockprintf but for X10 events. Binary clients get ev. */
+int evprintf(int fd, x10event_t *ev, const char *fmt, ...)
+{
+    va_list args;
+    int rc;
+
+    va_start(args,fmt);
+    rc = vsockprintf(fd, ev, fmt, args);
+    va_end(args);
+    return rc;
 }
 
 static void _hexdump(void *p, size_t len, char *outbuf, size_t outlen)
 {
+    static const char Hexdigits[] = "0123456789ABCDEF";
     unsigned char *ptr = (unsigned char*) p;
     size_t l;
 
-    if (len == 0) return;
-    if (len > (outlen / 3))
-        l = outlen / 3;
+    if (outlen == 0) return;
+    if (len > ((outlen - 1) / 3))
+        l = (outlen - 1) / 3;
     else
         l = len;
     while (l--) {
-        sprintf(outbuf, "%02X ", *ptr++);
-        outbuf += 3;
+        *outbuf++ = Hexdigits[*ptr >> 4];
+        *outbuf++ = Hexdigits[*ptr++ & 0x0F];
+        *outbuf++ = ' ';
     }
+    *outbuf = '\0';
 }
 
 void hexdump(void *p, size_t len)
@@ -221,138 +257,15 @@ void sockhexdump(int fd, void *p, size_t len)
 void mh_sockhexdump(int fd, void *p, size_t len)
 {
     char buf[(3*100)+1];
+    x10event_t ev;
 
+    event_init(&ev, EV_RX, EV_RAW, p, len);
     _hexdump(p, len, buf, sizeof(buf));
-    sockprintf(fd, "Raw data received: %s\n", buf);
+    evprintf(fd, &ev, "Raw data received: %s\n", buf);
 }
 
 
 static int Do_exit = 0;
-static int Reattach = 0;
-
-static void init_client(void)
-{
-    int i;
-
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        Clientsocks[i].fd = Clientxmlsocks[i].fd = Clientor20socks[i].fd = -1;
-    }
-    NClients = NxmlClients = Nor20Clients = 0;
-}
-
-/* Add new socket client */
-static int add_client(int fd)
-{
-    int i;
-
-    dbprintf("add_client(%d)\n", fd);
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if (Clientsocks[i].fd == -1) {
-            Clientsocks[i].fd = fd;
-            Clientsocks[i].events = POLLIN;
-            Clientsocks[i].revents = 0;
-            NClients++;
-            dbprintf("add_client: i %d NClients %d\n", i, NClients);
-            return 0;
-        }
-    }
-    dbprintf("max clients exceeded %d\n", i);
-    return -1;
-}
-
-/* Add new flashxml socket client */
-static int add_xmlclient(int fd)
-{
-    int i;
-
-    dbprintf("add_xmlclient(%d)\n", fd);
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if (Clientxmlsocks[i].fd == -1) {
-            Clientxmlsocks[i].fd = fd;
-            Clientxmlsocks[i].events = POLLIN;
-            Clientxmlsocks[i].revents = 0;
-            NxmlClients++;
-            dbprintf("add_xmlclient: i %d NxmlClients %d\n", i, NxmlClients);
-            return 0;
-        }
-    }
-    dbprintf("max XML clients exceeded %d\n", i);
-    return -1;
-}
-
-/* Add new or20 socket client */
-static int add_or20client(int fd)
-{
-    int i;
-
-    dbprintf("add_or20client(%d)\n", fd);
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if (Clientor20socks[i].fd == -1) {
-            Clientor20socks[i].fd = fd;
-            Clientor20socks[i].events = POLLIN;
-            Clientor20socks[i].revents = 0;
-            Nor20Clients++;
-            dbprintf("add_or20client: i %d Nor20Clients %d\n", i, Nor20Clients);
-            return 0;
-        }
-    }
-    dbprintf("max OR20 clients exceeded %d\n", i);
-    return -1;
-}
-
-/* Delete socket client */
-int del_client(int fd)
-{
-    int i;
-
-    dbprintf("del_client(%d)\n", fd);
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if (Clientsocks[i].fd == fd) {
-            Clientsocks[i].fd = -1;
-            NClients--;
-            dbprintf("del_client: i %d NClients %d\n", i, NClients);
-            return 0;
-        }
-        if (Clientxmlsocks[i].fd == fd) {
-            Clientxmlsocks[i].fd = -1;
-            NxmlClients--;
-            dbprintf("del_client: i %d NxmlClients %d\n", i, NxmlClients);
-            return 0;
-        }
-        if (Clientor20socks[i].fd == fd) {
-            shutdown(fd, SHUT_RDWR);
-            close(fd);
-            Clientor20socks[i].fd = -1;
-            Nor20Clients--;
-            dbprintf("del_client: i %d Nor20Clients %d\n", i, Nor20Clients);
-            return 0;
-        }
-    }
-    dbprintf("del_client:fd not found %d\n", fd);
-    return -1;
-}
-
-/* Copy socket client records to array */
-static int copy_clients(struct pollfd *Clients)
-{
-    int i;
-
-    dbprintf("copy_clients\n");
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if (Clientsocks[i].fd != -1) {
-            *Clients++ = Clientsocks[i];
-        }
-        if (Clientxmlsocks[i].fd != -1) {
-            *Clients++ = Clientxmlsocks[i];
-        }
-        if (Clientor20socks[i].fd != -1) {
-            *Clients++ = Clientor20socks[i];
-        }
-    }
-    dbprintf("copy_clients %d\n", NClients+NxmlClients+Nor20Clients);
-    return NClients+NxmlClients+Nor20Clients;
-}
-/* Client sockets */
 
 #include "x10state.h"
 #include "x10_write.h"
@@ -394,56 +307,46 @@ static const struct binarydata initcm19abinary[] = {
 };
 
 
-static void initcm1Xa(const struct binarydata *p)
+static void initcm1Xa(int ctlr, const struct binarydata *p)
 {
-    dbprintf("initcm1Xa\n");
+    dbprintf("initcm1Xa %d\n", ctlr);
     while (p->binlength) {
-        x10_write((unsigned char *)p->bindata, p->binlength);
+        x10_write_ctlr(ctlr, (unsigned char *)p->bindata, p->binlength);
         p++;
     }
 }
 
-/* Find CM15A or CM19A. The EU versions (CM15Pro and CM19Pro) have the same
- * vendor and product IDs, respectively.
+/* Claim the interface of an opened CM15A or CM19A, detaching the kernel
+ * driver if it has it.
  */
-static int find_cm15a(struct libusb_device_handle **devhptr)
+static int claim_controller(controller_t *ctl)
 {
     int r;
 
-    Cm19a = 0;
-    *devhptr = libusb_open_device_with_vid_pid(NULL,  0x0bc7, 0x0001);
-    if (!*devhptr) {
-        *devhptr = libusb_open_device_with_vid_pid(NULL,  0x0bc7, 0x0002);
-        if (!*devhptr) {
-            syslog(LOG_EMERG, "libusb_open_device_with_vid_pid failed");
-            return -EIO;
-        }
-        Cm19a = 1;
-    }
-    r = libusb_claim_interface(*devhptr, 0);
+    r = libusb_claim_interface(ctl->devh, 0);
     if (r == 0) {
-        syslog(LOG_NOTICE, (Cm19a) ? "Found CM19A" : "Found CM15A");
+        syslog(LOG_NOTICE, (ctl->cm19a) ? "Found CM19A" : "Found CM15A");
         return 0;
     }
     syslog(LOG_EMERG, "usb_claim_interface failed %d", r);
-    r = libusb_kernel_driver_active(*devhptr, 0);
+    r = libusb_kernel_driver_active(ctl->devh, 0);
     if (r < 0) {
         syslog(LOG_EMERG, "Kernel driver check failed %d", r);
         return -EIO;
     }
     syslog(LOG_NOTICE, "Found kernel driver %d, trying detach", r);
-    r = libusb_detach_kernel_driver(*devhptr, 0);
+    r = libusb_detach_kernel_driver(ctl->devh, 0);
     if (r < 0) {
         syslog(LOG_EMERG, "Kernel driver detach failed %d", r);
         return -EIO;
     }
-    Reattach = 1;
-    r = libusb_claim_interface(*devhptr, 0);
+    ctl->reattach = 1;
+    r = libusb_claim_interface(ctl->devh, 0);
     if (r < 0) {
         syslog(LOG_EMERG, "claim interface failed again %d", r);
         return -EIO;
     }
-    syslog(LOG_NOTICE, (Cm19a) ? "Found CM19A" : "Found CM15A");
+    syslog(LOG_NOTICE, (ctl->cm19a) ? "Found CM19A" : "Found CM15A");
     return 0;
 }
 
@@ -491,55 +394,63 @@ static int get_endpoint_address(libusb_device_handle *devh, uint8_t *inendpt, ui
     return 0;
 }
 
-static void IntrOut_cb(struct libusb_transfer *transfer)
+/* Give back a controller opened by find_controllers() */
+static void close_controller(controller_t *ctl)
 {
-    /* dbprintf("IntrOut callback len %d\n", transfer->actual_length); */
+    libusb_release_interface(ctl->devh, 0);
+    if (ctl->reattach) libusb_attach_kernel_driver(ctl->devh, 0);
+    libusb_close(ctl->devh);
+    ctl->devh = NULL;
 }
 
-static void IntrIn_cb(struct libusb_transfer *transfer)
+/* Open every CM15A and CM19A, up to CTLR_MAX. The EU versions (CM15Pro
+ * and CM19Pro) have the same vendor and product IDs, respectively.
+ */
+static int find_controllers(void)
 {
-#if 0
-    int fd, i;
-#endif
-
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        dbprintf("IntrIn transfer status %d?\n", transfer->status);
-        Do_exit = 2;
-        libusb_free_transfer(transfer);
-        IntrIn_transfer = NULL;
-        return;
-    }
-
-    /* dbprintf("IntrIn callback len %d ", transfer->actual_length); */
-    /* hexdump(transfer->buffer, transfer->actual_length); */
+    libusb_device **list;
+    struct libusb_device_descriptor desc;
+    controller_t *ctl;
+    ssize_t n, i;
+    int r;
 
-/*        if ((transfer->actual_length == 1) && (*transfer->buffer == 0x55)) {  */
-    if (transfer->actual_length == 1) {
-        send_next_x10out();
+    n = libusb_get_device_list(NULL, &list);
+    if (n < 0) {
+        syslog(LOG_EMERG, "libusb_get_device_list failed %d", (int)n);
+        return -EIO;
     }
-
-#if 0
-    /* Incoming USB data is sent to all sockets */
-    for (i = 0; i < MAXCLISOCKETS; i++) {
-        if ((fd = Clientsocks[i].fd) > 0) {
-            cm15a_decode(fd, transfer->buffer, transfer->actual_length);
+    Cm19a = 1;
+    for (i = 0; (i < n) && (Ncontrollers < CTLR_MAX); i++) {
+        if (libusb_get_device_descriptor(list[i], &desc) < 0) continue;
+        if ((desc.idVendor != 0x0bc7) ||
+                ((desc.idProduct != 0x0001) && (desc.idProduct != 0x0002)))
+            continue;
+        ctl = &Controllers[Ncontrollers];
+        memset(ctl, 0, sizeof(*ctl));
+        ctl->cm19a = (desc.idProduct == 0x0002);
+        r = libusb_open(list[i], &ctl->devh);
+        if (r < 0) {
+            syslog(LOG_ERR, "libusb_open failed %d", r);
+            continue;
         }
-    }
-#else
-    cm15a_decode(-1, transfer->buffer, transfer->actual_length);
-#endif
-    if (libusb_submit_transfer(IntrIn_transfer) < 0)
-        Do_exit = 2;
-}
-
-static int start_transfers(void)
-{
-    int r;
-
-    r = libusb_submit_transfer(IntrIn_transfer);
-    if (r < 0)
-        return r;
-    return 0;
+        if (claim_controller(ctl) < 0) {
+            libusb_close(ctl->devh);
+            continue;
+        }
+        r = get_endpoint_address(ctl->devh, &ctl->inendpt, &ctl->outendpt);
+        if (r < 0) {
+            syslog(LOG_ERR, "Could not find endpoints %d", r);
+            close_controller(ctl);
+            continue;
+        }
+        syslog(LOG_NOTICE, "Controller %d In endpoint 0x%02X, "
+                "Out endpoint 0x%02X", Ncontrollers, ctl->inendpt,
+                ctl->outendpt);
+        if (!ctl->cm19a) Cm19a = 0;
+        Ncontrollers++;
+    }
+    libusb_free_device_list(list, 1);
+    return (Ncontrollers) ? 0 : -EIO;
 }
 
 static int do_init(void)
@@ -549,41 +460,6 @@ static int do_init(void)
     return 0;
 }
 
-static int alloc_transfers(void)
-{
-    IntrIn_transfer = libusb_alloc_transfer(0);
-    if (!IntrIn_transfer)
-        return -ENOMEM;
-    libusb_fill_interrupt_transfer(IntrIn_transfer, Devh, InEndpoint, 
-            IntrInBuf, sizeof(IntrInBuf), IntrIn_cb, NULL, 0);
-
-    IntrOut_transfer = libusb_alloc_transfer(0);
-    if (!IntrOut_transfer)
-        return -ENOMEM;
-    return 0;
-}
-
-int write_usb(unsigned char *buf, size_t len)
-{
-    int r, i;
-
-    dbprintf("usb len %lu ", (unsigned long)len);
-    hexdump(buf, len);
-    memcpy(IntrOutBuf, buf, len);
-    libusb_fill_interrupt_transfer(IntrOut_transfer, Devh, OutEndpoint, 
-            IntrOutBuf, len, IntrOut_cb, NULL, 0);
-    r = libusb_submit_transfer(IntrOut_transfer);
-    if (r < 0) {
-        libusb_cancel_transfer(IntrOut_transfer);
-        i = 100;
-        while (IntrOut_transfer && i--)
-            if (libusb_handle_events(NULL) < 0)
-                break;
-        return r;
-    }
-    return 0;
-}
-
 static void sighandler(int signum)
 {
     Do_exit = 1;	
@@ -591,23 +467,10 @@ static void sighandler(int signum)
 
 static int mydaemon(void)
 {
-    int nready, i;
-
-    /**** sockets ****/
-    socklen_t clilen; 
-    int clifd, listenfd, flashxmlfd, or20fd;
-    unsigned char buf[1024];
-    int bytesIn;
-    struct sockaddr_in cliaddr, servaddr;
-    int rc;
-    static const int optval=1;
-
     /**** USB ****/
     struct sigaction sigact;
-    int r = 1;
-    const struct libusb_pollfd **usbfds;
-    nfds_t nusbfds;
-    struct timeval timeout;
+    controller_t *ctl;
+    int i, r = 1;
 
     hua_sec_init();
 
@@ -619,6 +482,12 @@ static int mydaemon(void)
     }
     libusb_set_debug(NULL, 3);
 
+    r = reactor_init();
+    if (r < 0) {
+        syslog(LOG_EMERG, "failed to initialise epoll %d", r);
+        goto out;
+    }
+
 #if 0
     /* This function is not available in older versions of libusb-1.0 */
     r = libusb_pollfds_handle_timeouts(NULL);
@@ -627,31 +496,25 @@ static int mydaemon(void)
         goto out;
     }
 #endif
-    r = find_cm15a(&Devh);
+    r = find_controllers();
     if (r < 0) {
         syslog(LOG_EMERG, "Could not find/open CM15A/CM19A %d", r);
         dbprintf("Could not find/open CM15A/CM19A %d\n", r);
         goto out;
     }
 
-    r = get_endpoint_address(Devh, &InEndpoint, &OutEndpoint);
-    if (r < 0) {
-        syslog(LOG_EMERG, "Could not find endpoints %d", r);
-        dbprintf("Could not find endpoints %d\n", r);
-        goto out_deinit;
-    }
-    syslog(LOG_NOTICE, "In endpoint 0x%02X, Out endpoint 0x%02X",
-            InEndpoint, OutEndpoint);
-
     r = do_init();
     if (r < 0)
         goto out_deinit;
 
-    r = alloc_transfers();
-    if (r < 0)
-        goto out_deinit;
-
-    r = start_transfers();
+    for (i = 0; i < Ncontrollers; i++) {
+        ctl = &Controllers[i];
+        r = usbio_add(ctl->devh, ctl->inendpt, ctl->outendpt, ctl->cm19a);
+        if (r < 0)
+            goto out_deinit;
+        x10_ctlr_add(r, ctl->cm19a);
+    }
+    r = usbio_start();
     if (r < 0)
         goto out_deinit;
 
@@ -662,187 +525,43 @@ static int mydaemon(void)
     sigaction(SIGTERM, &sigact, NULL);
     sigaction(SIGQUIT, &sigact, NULL);
 
-    usbfds = libusb_get_pollfds(NULL);
-    dbprintf("usbfds %p %p %p %p %p\n", usbfds, 
-            usbfds[0], usbfds[1], usbfds[2], usbfds[3]);
-    nusbfds = 3;        /* Skip over listen fd at [0,1,2] */
-    for (i = 0; usbfds[i] != NULL; i++) {
-        dbprintf(" %lu: %p fd %d %04X\n", nusbfds, 
-                usbfds[i], usbfds[i]->fd, usbfds[i]->events);
-        Clients[nusbfds].fd = usbfds[i]->fd;
-        Clients[nusbfds].events = usbfds[i]->events;
-        Clients[nusbfds].revents = 0;
-        nusbfds++;
-    }
-    nusbfds -= 3;  /* Adjust for skipping 0,1,2 */
-    dbprintf("nusbfds %lu\n", nusbfds);
-    memset(&timeout, 0, sizeof(timeout));
-    if (Cm19a)
-        initcm1Xa(initcm19abinary);
-    else
-        initcm1Xa(initcm15abinary);
+    for (i = 0; i < Ncontrollers; i++)
+        initcm1Xa(i, (Controllers[i].cm19a) ?
+                initcm19abinary : initcm15abinary);
 
     /**** sockets ****/
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    dbprintf("listenfd %d\n", listenfd);
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(SERVER_PORT);
-
-    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    dbprintf("setsockopt() %d/%d\n", rc, errno);
-    rc = bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr));
-    dbprintf("bind() %d/%d\n", rc, errno);
-    rc = listen(listenfd, 128);
-    dbprintf("listen() %d/%d\n", rc, errno);
-
+    if (client_listen(CLIENT_PLAIN, SERVER_PORT, 0) < 0)
+        syslog(LOG_ERR, "Could not listen on port %d", SERVER_PORT);
     /* Listen socket for Flash XML clients */
-    flashxmlfd = socket(AF_INET, SOCK_STREAM, 0);
-    dbprintf("flashxmlfd %d\n", flashxmlfd);
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(SERVER_PORT+1);
-
-    rc = setsockopt(flashxmlfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    dbprintf("setsockopt() %d/%d\n", rc, errno);
-    rc = bind(flashxmlfd, (struct sockaddr*) &servaddr, sizeof(servaddr));
-    dbprintf("bind() %d/%d\n", rc, errno);
-    rc = listen(flashxmlfd, 128);
-    dbprintf("listen() %d/%d\n", rc, errno);
-
-    /* Listen socket for OR 2.0 clients */
-    or20fd = socket(AF_INET, SOCK_STREAM, 0);
-    dbprintf("or20fd %d\n", or20fd);
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(SERVER_PORT+2);
-
-    rc = setsockopt(or20fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    dbprintf("setsockopt() %d/%d\n", rc, errno);
-    rc = bind(or20fd, (struct sockaddr*) &servaddr, sizeof(servaddr));
-    dbprintf("bind() %d/%d\n", rc, errno);
-    rc = listen(or20fd, 128);
-    dbprintf("listen() %d/%d\n", rc, errno);
-
+    if (client_listen(CLIENT_XML, SERVER_PORT+1, 0) < 0)
+        syslog(LOG_ERR, "Could not listen on port %d", SERVER_PORT+1);
+    /* Listen socket for OR 2.0 clients. One command per connection. */
+    if (client_listen(CLIENT_OR20, SERVER_PORT+2, CLIENTOPT_ONESHOT) < 0)
+        syslog(LOG_ERR, "Could not listen on port %d", SERVER_PORT+2);
+    /* Listen socket for binary event stream clients */
+    if (client_listen(CLIENT_BINARY, SERVER_PORT+3, CLIENTOPT_NOTIFY) < 0)
+        syslog(LOG_ERR, "Could not listen on port %d", SERVER_PORT+3);
+    /* Listen socket for HTTP JSON state and SSE clients */
+    if (client_listen(CLIENT_HTTP, SERVER_PORT+4, 0) < 0)
+        syslog(LOG_ERR, "Could not listen on port %d", SERVER_PORT+4);
+
+    command_fd = client_pipe();
     init_sensorflare(Cm19a);
 
     char connectedMessage[30];
     sprintf(connectedMessage,"Connected %s\n",Cm19a?"CM19A":"CM15A");
     sendMessage(connectedMessage);
     
-    init_client();
-    Clients[0].fd = listenfd;
-    Clients[0].events = POLLIN;
-    Clients[1].fd = flashxmlfd;
-    Clients[1].events = POLLIN;
-    Clients[2].fd = or20fd;
-    Clients[2].events = POLLIN;
-    PollTimeOut = -1;
-
     while (!Do_exit) {
-        int nsockclients;
-        int npollfds;
-
-        /* Start appending records for socket clients to Clients array after 
-         * listen, flashxml listen, or20 listen, and USB records
-         */
-        nsockclients = copy_clients(&Clients[3+nusbfds]);
-        /* 1 for listen socket, 1 for flashxml listen socket, 1 for or20 listen
-         * socket, nusbfds for libusb, nsockclients for socket clients
-         */
-        npollfds = 3 + nusbfds + nsockclients;
-        nready = poll(Clients, npollfds, PollTimeOut);
-#if 0
-        dbprintf("poll() %d\n", nready);
-        for (i = 0; i < npollfds; i++) {
-            dbprintf("Clients[%d] fd %d events %X revents %X\n",
-                    i, Clients[i].fd, Clients[i].events, Clients[i].revents);
-        }
-#endif
-        /**** Time out ****/
-        if (nready == 0) {
-            send_next_x10out();
-        }
-        else {
-            /**** USB ****/
-            libusb_handle_events_timeout(NULL, &timeout);
-
-            /**** listen sockets ****/
-            if (Clients[0].revents & POLLIN) {
-                /* new client connection */
-                clilen = sizeof(cliaddr);
-                clifd  = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen);
-                dbprintf("accept() %d/%d\n", clifd, errno);
-                syslog(LOG_INFO,"accept() %d/%d\n", clifd, errno);
-                r = add_client(clifd);
-                if (--nready <= 0) continue;
-            }
-            if (Clients[1].revents & POLLIN) {
-                /* new flashxml client connection */
-                clilen = sizeof(cliaddr);
-                clifd  = accept(flashxmlfd, (struct sockaddr *)&cliaddr, &clilen);
-                dbprintf("flashxml accept() %d/%d\n", clifd, errno);
-                r = add_xmlclient(clifd);
-                if (--nready <= 0) continue;
-            }
-
-            if (Clients[2].revents & POLLIN) {
-                /* new OR2.0 client connection */
-                clilen = sizeof(cliaddr);
-                clifd  = accept(or20fd, (struct sockaddr *)&cliaddr, &clilen);
-                dbprintf("or20 accept() %d/%d\n", clifd, errno);
-                r = add_or20client(clifd);
-                if (--nready <= 0) continue;
-            }
-
-            for (i = 3+nusbfds; i < npollfds; i++) {
-                if ((clifd = Clients[i].fd) >= 0) {
-                    /* dbprintf("client %d revents 0x%X\n", i, Clients[i].revents); */
-                    if (Clients[i].revents & (POLLIN|POLLERR)) {
-                        if ((bytesIn = read(clifd, buf, sizeof(buf))) < 0) {
-                            dbprintf("read err %d\n", errno);
-                            if (errno != ECONNRESET) {
-                                dbprintf("serious error %d\n", errno);
-                            }
-                            close(clifd);
-                            del_client(clifd);
-                        }
-                        else if (bytesIn == 0) {
-                            dbprintf("read EOF %d\n", bytesIn);
-                            close(clifd);
-                            del_client(clifd);
-                        }
-                        else {
-                            syslog(LOG_INFO,"encoding command");
-                            cm15a_encode(clifd, buf, (size_t)bytesIn);
-                        }
-                        if (--nready <= 0) break;
-                    }
-                }
-            }
-        }
-    }
-    syslog(LOG_NOTICE, (Cm19a) ? "detaching CM19A" : "detaching CM15A");
-
-    if (IntrOut_transfer) {
-        r = libusb_cancel_transfer(IntrOut_transfer);
-        if (r < 0)
-            goto out_deinit;
-    }
-
-    if (IntrIn_transfer) {
-        r = libusb_cancel_transfer(IntrIn_transfer);
-        if (r < 0)
-            goto out_deinit;
+        reactor_run(client_poll_timeout(x10_poll_timeout()));
+        if (usbio_failed()) Do_exit = 2;
+        /**** ACK deadline, whether or not anything else happened ****/
+        x10_timeout();
+        /* Commands held back by --tx-overflow block */
+        client_unhold();
     }
-
-    i = 100;
-    while ((IntrOut_transfer || IntrIn_transfer) && i--)
-        if (libusb_handle_events(NULL) < 0)
-            break;
+    syslog(LOG_NOTICE, "detaching %d controller%s", Ncontrollers,
+            (Ncontrollers == 1) ? "" : "s");
 
     if (Do_exit == 1)
         r = 0;
@@ -850,14 +569,14 @@ static int mydaemon(void)
         r = 1;
 
 out_deinit:
-    libusb_free_transfer(IntrIn_transfer);
-    libusb_free_transfer(IntrOut_transfer);
-/* out_release: */
-    libusb_release_interface(Devh, 0);
+    usbio_stop();
+    client_closeall();
 out:
-    libusb_close(Devh);
-    if (Reattach) libusb_attach_kernel_driver(Devh, 0);
+    for (i = 0; i < Ncontrollers; i++)
+        close_controller(&Controllers[i]);
+    Ncontrollers = 0;
     libusb_exit(NULL);
+    reactor_exit();
     return r >= 0 ? r : -r;
 }
 
@@ -872,13 +591,11 @@ static void printcopy(void)
     fflush(NULL);
 }
 
-// This affects whether decode.c will show raw frame data for debugging RF connectivity
-// as well as providing raw data for parsing by users like misterhouse's X10_CMxx module.
-int raw_data = 0;
 int main(int argc, char *argv[])
 {
     int rc, i;
     int foreground=0;
+    size_t replaysize = REPLAY_DEFAULT;
 
     /* Initialize logging */
     openlog(DAEMON_NAME, LOG_PID, LOG_LOCAL5);
@@ -890,6 +607,51 @@ int main(int argc, char *argv[])
             foreground = 1;
         else if (strcmp(argv[i], "--raw-data") == 0)
             raw_data = 1;
+        else if ((strcmp(argv[i], "--max-queue") == 0) && (i+1 < argc))
+            ClientMaxQueue = strtoul(argv[++i], NULL, 10);
+        else if ((strcmp(argv[i], "--lane-policy") == 0) && (i+1 < argc)) {
+            i++;
+            if (strcmp(argv[i], "rf-first") == 0)
+                LanePolicy = LANE_RFFIRST;
+            else if (strcmp(argv[i], "round-robin") == 0)
+                LanePolicy = LANE_ROUNDROBIN;
+            else {
+                printf("unknown lane policy %s\n", argv[i]);
+                exit(-1);
+            }
+        }
+        else if ((strcmp(argv[i], "--max-latency") == 0) && (i+1 < argc))
+            MaxLatency = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--rf-window") == 0) && (i+1 < argc))
+            RfWindow = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--tx-queue") == 0) && (i+1 < argc))
+            TxQueueMax = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--tx-overflow") == 0) && (i+1 < argc)) {
+            i++;
+            if (strcmp(argv[i], "reject") == 0)
+                TxOverflow = OVERFLOW_REJECT;
+            else if (strcmp(argv[i], "drop-oldest") == 0)
+                TxOverflow = OVERFLOW_DROPOLDEST;
+            else if (strcmp(argv[i], "block") == 0)
+                TxOverflow = OVERFLOW_BLOCK;
+            else {
+                printf("unknown overflow policy %s\n", argv[i]);
+                exit(-1);
+            }
+        }
+        else if ((strcmp(argv[i], "--replay") == 0) && (i+1 < argc))
+            replaysize = strtoul(argv[++i], NULL, 10);
+        else if ((strcmp(argv[i], "--slow-client") == 0) && (i+1 < argc)) {
+            i++;
+            if (strcmp(argv[i], "drop") == 0)
+                ClientSlowPolicy = SLOW_DROP;
+            else if (strcmp(argv[i], "close") == 0)
+                ClientSlowPolicy = SLOW_CLOSE;
+            else {
+                printf("unknown slow client policy %s\n", argv[i]);
+                exit(-1);
+            }
+        }
         else if (strcmp(argv[i], "--version") == 0) {
             printf("%s\n", PACKAGE_STRING);
             printcopy();
@@ -901,6 +663,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (replay_init(replaysize) < 0) {
+        printf("no memory for %lu replay events\n", (unsigned long)replaysize);
+        exit(-1);
+    }
+
     /* Daemonize */
     if (!foreground) {
         rc = daemon(0, 0);
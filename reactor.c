@@ -0,0 +1,118 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* epoll main loop
+ * Listen sockets, client sockets, and libusb file descriptors are registered
+ * once and stay registered until they go away. Each wakeup only costs the
+ * number of ready descriptors, not the number of connected clients.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include "global.h"
+#include "reactor.h"
+#include "client.h"
+
+#define MAXEVENTS       (64)
+
+static int Epollfd = -1;
+
+int reactor_init(void)
+{
+    Epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (Epollfd < 0) {
+        dbprintf("epoll_create1 -1/%d\n", errno);
+        return -errno;
+    }
+    return 0;
+}
+
+int reactor_add(pollsrc_t *src, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(Epollfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+        dbprintf("epoll_ctl ADD %d -1/%d\n", src->fd, errno);
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_mod(pollsrc_t *src, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(Epollfd, EPOLL_CTL_MOD, src->fd, &ev) < 0) {
+        dbprintf("epoll_ctl MOD %d -1/%d\n", src->fd, errno);
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_del(pollsrc_t *src)
+{
+    /* Kernels before 2.6.9 require a non-NULL event for EPOLL_CTL_DEL */
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    if (epoll_ctl(Epollfd, EPOLL_CTL_DEL, src->fd, &ev) < 0) {
+        dbprintf("epoll_ctl DEL %d -1/%d\n", src->fd, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait for up to timeout milliseconds (-1 = forever) then dispatch every
+ * ready descriptor to its handler. Returns the number of ready descriptors,
+ * 0 on time out, or -1 on error (including EINTR).
+ */
+int reactor_run(int timeout)
+{
+    struct epoll_event events[MAXEVENTS];
+    pollsrc_t *src;
+    int nready, i;
+
+    nready = epoll_wait(Epollfd, events, MAXEVENTS, timeout);
+    for (i = 0; i < nready; i++) {
+        src = events[i].data.ptr;
+        /* A handler earlier in this batch may have closed this one */
+        if (src->fd < 0) continue;
+        src->handler(src, events[i].events);
+    }
+    /* Now nothing in events[] can point at a deleted client */
+    client_reap();
+    return nready;
+}
+
+void reactor_exit(void)
+{
+    if (Epollfd >= 0) {
+        close(Epollfd);
+        Epollfd = -1;
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* Anything that wants to be woken up by the main loop embeds one of these.
+ * The handler is called with the epoll event bits (EPOLLIN, EPOLLOUT, ...).
+ */
+typedef struct pollsrc pollsrc_t;
+typedef void (*pollsrc_handler_t)(pollsrc_t *src, uint32_t events);
+
+struct pollsrc {
+    int fd;
+    pollsrc_handler_t handler;
+};
+
+int reactor_init(void);
+
+int reactor_add(pollsrc_t *src, uint32_t events);
+
+int reactor_mod(pollsrc_t *src, uint32_t events);
+
+int reactor_del(pollsrc_t *src);
+
+int reactor_run(int timeout);
+
+void reactor_exit(void);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+static replayent_t *Ring = NULL;
+static size_t Ringsize = 0;
+static size_t Ringcount = 0;    /* Number of events held */
+static uint32_t Lastseq = 0;    /* Newest event added */
+
+/* Allocate room for nevents. 0 disables replay. */
+int replay_init(size_t nevents)
+{
+    if (nevents == 0) return 0;
+    Ring = calloc(nevents, sizeof(Ring[0]));
+    if (Ring == NULL) return -1;
+    Ringsize = nevents;
+    return 0;
+}
+
+/* Keep a copy of a broadcast event. ev must already have its sequence
+ * number, one more than the last event added. A text line that does not
+ * fit is cut short.
+ */
+void replay_add(const x10event_t *ev, const char *text, size_t len)
+{
+    replayent_t *ent;
+
+    Lastseq = ev->seq;
+    if (Ringsize == 0) return;
+    ent = &Ring[ev->seq % Ringsize];
+    ent->ev = *ev;
+    if (len > sizeof(ent->text)) {
+        len = sizeof(ent->text);
+        memcpy(ent->text, text, len - 1);
+        ent->text[len - 1] = '\n';
+    }
+    else
+        memcpy(ent->text, text, len);
+    ent->len = len;
+    if (Ringcount < Ringsize) Ringcount++;
+}
+
+/* Oldest sequence number held. replay_last() + 1 if nothing is held. */
+uint32_t replay_first(void)
+{
+    return Lastseq - Ringcount + 1;
+}
+
+/* Newest sequence number sent, 0 if none */
+uint32_t replay_last(void)
+{
+    return Lastseq;
+}
+
+/* Event seq, or NULL if it has been overwritten or not happened yet */
+const replayent_t *replay_get(uint32_t seq)
+{
+    if ((seq < replay_first()) || (seq > Lastseq)) return NULL;
+    return &Ring[seq % Ringsize];
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+
+/* The last N broadcast events, kept so a client that reconnects can RESUME
+ * from the last sequence number it saw. The ring is allocated once at
+ * startup and old events are overwritten.
+ */
+
+#define REPLAY_DEFAULT  (256)   /* Events kept unless --replay is given */
+#define REPLAY_TEXT     (128)   /* Longest text line kept per event */
+
+typedef struct replayent {
+    x10event_t ev;
+    size_t len;
+    char text[REPLAY_TEXT];     /* Plain text line, newline terminated */
+} replayent_t;
+
+int replay_init(size_t nevents);
+
+void replay_add(const x10event_t *ev, const char *text, size_t len);
+
+uint32_t replay_first(void);
+
+uint32_t replay_last(void);
+
+const replayent_t *replay_get(uint32_t seq);
+
+#endif
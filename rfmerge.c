@@ -0,0 +1,200 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "global.h"
+#include "rfmerge.h"
+
+/* One RF frame recently heard, without the 0x5D receive prefix */
+typedef struct rfheard {
+    size_t len;                 /* 0 if unused */
+    unsigned char frame[8];
+    int owner;                  /* Receiver whose copies are decoded, or
+                                   RFMERGE_TX if sent */
+    unsigned int heard;         /* Bit per receiver that heard it */
+    uint64_t firstus;
+    uint64_t lastus;            /* Owner's last copy, or last echo */
+} rfheard_t;
+
+/* Per receiver counts */
+typedef struct rfrecv {
+    unsigned long frames;       /* RF frames received */
+    unsigned long first;        /* Heard first, decoded */
+    unsigned long dups;         /* Heard after another receiver, dropped */
+    unsigned long only;         /* Heard by no other receiver */
+    unsigned long echoes;       /* Frames sent heard back, dropped */
+} rfrecv_t;
+
+static rfheard_t Heard[RFMERGE_MAX];
+static rfrecv_t Recv[CTLR_MAX];
+
+/* Count a frame that nobody else heard before its slot is reused */
+static void rfmerge_retire(rfheard_t *h)
+{
+    if ((h->len != 0) && (h->owner != RFMERGE_TX) &&
+            (h->heard == (1U << h->owner)))
+        Recv[h->owner].only++;
+    h->len = 0;
+}
+
+/* Slot holding frame buf, or the one to reuse for it if *found is 0 */
+static rfheard_t *rfmerge_find(const unsigned char *buf, size_t len,
+        uint64_t now, int *found)
+{
+    rfheard_t *h, *spare = NULL;
+    int i;
+
+    *found = 0;
+    for (i = 0; i < RFMERGE_MAX; i++) {
+        h = &Heard[i];
+        if ((h->len != 0) && (now - h->lastus > (uint64_t)RFMERGE_MS * 1000))
+            rfmerge_retire(h);
+        if (h->len == 0) {
+            if ((spare == NULL) || (spare->len != 0)) spare = h;
+            continue;
+        }
+        if ((h->len != len) || memcmp(h->frame, buf, len)) {
+            /* Oldest in use goes if the table is full */
+            if ((spare == NULL) || ((spare->len != 0) &&
+                        (h->lastus < spare->lastus)))
+                spare = h;
+            continue;
+        }
+        *found = 1;
+        return h;
+    }
+    rfmerge_retire(spare);
+    return spare;
+}
+
+/* RF frame buf from controller ctlr. Returns 1 if another receiver
+ * already heard it, or it is the echo of a frame sent, and it should not
+ * be decoded, else 0. Frames that are not RF are always decoded.
+ */
+int rfmerge_rx(int ctlr, int cm19a, const unsigned char *buf, size_t len)
+{
+    rfheard_t *h;
+    uint64_t now;
+    int found;
+
+    if ((ctlr < 0) || (ctlr >= CTLR_MAX)) return 0;
+    /* The CM15A puts 0x5D, sometimes more than one, before RF frames.
+     * The CM19A only does RF and sends the frame alone.
+     */
+    if (!cm19a) {
+        if ((len == 0) || (buf[0] != 0x5D)) return 0;
+        while ((len > 0) && (buf[0] == 0x5D)) {
+            buf++;
+            len--;
+        }
+    }
+    if ((len < 4) || (len > sizeof(Heard[0].frame))) return 0;
+
+    now = monotonic_us();
+    Recv[ctlr].frames++;
+    h = rfmerge_find(buf, len, now, &found);
+    if (found) {
+        if (h->owner == ctlr) {
+            /* Repeats from the owner are decoded, dup_filter() and the
+             * decoder decide what they mean
+             */
+            h->lastus = now;
+            return 0;
+        }
+        h->heard |= 1U << ctlr;
+        if (h->owner == RFMERGE_TX) {
+            /* The transmitter sends each frame several times */
+            h->lastus = now;
+            Recv[ctlr].echoes++;
+        }
+        else {
+            Recv[ctlr].dups++;
+        }
+        return 1;
+    }
+    h->len = len;
+    memcpy(h->frame, buf, len);
+    h->owner = ctlr;
+    h->heard = 1U << ctlr;
+    h->firstus = h->lastus = now;
+    Recv[ctlr].first++;
+    return 0;
+}
+
+/* RF frame buf, without the leading 0xEB, is being sent by one of the
+ * controllers. It takes over any copy already heard so the others hearing
+ * it are not taken for a new frame.
+ */
+void rfmerge_tx(const unsigned char *buf, size_t len)
+{
+    rfheard_t *h;
+    uint64_t now;
+    int found;
+
+    if ((len < 4) || (len > sizeof(Heard[0].frame))) return;
+    now = monotonic_us();
+    h = rfmerge_find(buf, len, now, &found);
+    if (found) rfmerge_retire(h);
+    h->len = len;
+    memcpy(h->frame, buf, len);
+    h->owner = RFMERGE_TX;
+    h->heard = 0;
+    h->firstus = h->lastus = now;
+}
+
+/* Report per receiver counts, and which receivers heard the recent
+ * frames
+ */
+void rfmerge_stats(int fd)
+{
+    rfheard_t *h;
+    rfrecv_t *r;
+    char hex[3 * sizeof(h->frame) + 1], who[4 * CTLR_MAX + 1], owner[12];
+    uint64_t now = monotonic_us();
+    size_t j;
+    int i, k;
+
+    for (i = 0; i < CTLR_MAX; i++) {
+        r = &Recv[i];
+        if (r->frames == 0) continue;
+        sockprintf(fd, "Receiver %d frames %lu first %lu dups %lu only %lu "
+                "echoes %lu\n", i, r->frames, r->first, r->dups, r->only,
+                r->echoes);
+    }
+    for (i = 0; i < RFMERGE_MAX; i++) {
+        h = &Heard[i];
+        if (h->len == 0) continue;
+        for (j = 0; j < h->len; j++)
+            sprintf(&hex[3 * j], "%02X ", h->frame[j]);
+        hex[3 * h->len - 1] = '\0';
+        who[0] = '\0';
+        for (k = 0; k < CTLR_MAX; k++)
+            if (h->heard & (1U << k))
+                sprintf(who + strlen(who), "%s%d", (who[0]) ? "," : "", k);
+        if (h->owner == RFMERGE_TX)
+            sprintf(owner, "tx");
+        else
+            sprintf(owner, "%d", h->owner);
+        sockprintf(fd, "Heard %s by %s first %s %lu ms ago\n", hex,
+                (who[0]) ? who : "none", owner,
+                (unsigned long)((now - h->firstus) / 1000));
+    }
+}
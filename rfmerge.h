@@ -0,0 +1,49 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RFMERGE_H
+#define RFMERGE_H
+
+#include <stddef.h>
+
+/* Merges the RF frames heard by several controllers. The first receiver
+ * to hear a frame owns it and its copies are decoded as usual. Copies of
+ * the same frame heard by other receivers within RFMERGE_MS of the
+ * owner's last copy are dropped before decode, so clients see one event
+ * however many receivers heard it. Which receivers heard each frame is
+ * counted per receiver to help with placement.
+ *
+ * The other controllers hear what one of them sends, so with more than
+ * one controller every RF frame sent is remembered too, owned by
+ * RFMERGE_TX. Copies of it heard within
+ * RFMERGE_MS are echoes and are dropped, else a repeat of a received
+ * frame could be heard and repeated again.
+ */
+
+#define RFMERGE_MAX     (32)    /* Recent frames remembered */
+#define RFMERGE_MS      (500)   /* How long a copy counts as the same */
+#define RFMERGE_TX      (-1)    /* Owner of frames sent */
+
+int rfmerge_rx(int ctlr, int cm19a, const unsigned char *buf, size_t len);
+
+void rfmerge_tx(const unsigned char *buf, size_t len);
+
+void rfmerge_stats(int fd);
+
+#endif
@@ -1,5 +1,19 @@
 #include "sensorflare.h"
 
+int command_fd = -1;
+
+/* Hand a command to the main loop. The main loop owns the client sockets
+ * and the X10 output queue so commands must not be run on this thread.
+ */
+static void post_command(const char *command) {
+    size_t len = strlen(command);
+
+    if (command_fd < 0) return;
+    if (write(command_fd, command, len) != (ssize_t) len ||
+	    write(command_fd, "\n", 1) != 1)
+	syslog(LOG_ERR, "post_command failed");
+}
+
 void die(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -230,7 +244,7 @@ void * receiver(void *receiver_thread_status_p) {
 	sprintf(buf, "%s", (char *) envelope.message.body.bytes);
 	buf[envelope.message.body.len] = '\0';
 	printf("%s", buf);
-	processcommandline(NULL, buf);
+	post_command(buf);
 
 
 	if (envelope.message.properties._flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
@@ -55,4 +55,7 @@ pthread_t rabbit_receiver_thread;
 char exchange[20];
 char commands_queue[20];
 bool sensorflare_connected;
+
+/* Write end of the pipe to the main loop, see client_pipe() */
+extern int command_fd;
 #endif
\ No newline at end of file
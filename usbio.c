@@ -0,0 +1,510 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The USB thread does nothing but move frames between the controllers and
+ * their rings, so an RF frame is picked up and the IN transfer resubmitted
+ * right away however long the network thread takes with clients. One
+ * thread handles every controller since they share the libusb context.
+ *
+ * Each ring has exactly one producer and one consumer. The producer owns
+ * head and the consumer owns tail, so no locks are needed, only barriers
+ * so the frame is written before head moves past it and read before tail
+ * lets it be reused.
+ *
+ * USBIN_POOL interrupt IN transfers per controller are kept submitted.
+ * Each is resubmitted as soon as its frame is in the ring, and the others
+ * are still queued at the host controller meanwhile, so a burst of RF
+ * frames arriving back to back is not lost waiting for one transfer to
+ * come back. The host completes them in the order they were submitted.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include "global.h"
+#include "reactor.h"
+#include "x10_write.h"
+#include "decode.h"
+#include "rfmerge.h"
+#include "usbio.h"
+
+typedef struct usbframe {
+    size_t len;
+    unsigned char data[8];
+} usbframe_t;
+
+typedef struct usbring {
+    volatile unsigned int head;     /* Next slot to fill */
+    volatile unsigned int tail;     /* Next slot to take */
+    unsigned long dropped;          /* Frames lost to a full ring */
+    usbframe_t slot[USBRING_SIZE];
+} usbring_t;
+
+/* One controller. The rings go controller to network thread and network
+ * thread to controller, and done says how each OUT transfer ended, one
+ * byte, 1 if it completed. The rest belongs to the USB thread once it
+ * runs.
+ */
+typedef struct usbctlr {
+    libusb_device_handle *devh;
+    uint8_t inendpt, outendpt;
+    int cm19a;
+    usbring_t rx, tx, done;
+    struct libusb_transfer *in[USBIN_POOL];
+    unsigned char inbuf[USBIN_POOL][8];
+    volatile int inpending;         /* IN transfers submitted */
+    struct libusb_transfer *out;
+    unsigned char outbuf[8];
+    int outbusy;
+    /* Written by the USB thread, read for STATS */
+    volatile unsigned long rxframes;
+    volatile unsigned long rxoverruns;  /* Frame too long, cut */
+    volatile unsigned long rxidle;      /* No IN transfer queued */
+    volatile unsigned long txframes;
+    volatile unsigned long txerrors;    /* OUT transfer did not complete */
+} usbctlr_t;
+
+static usbctlr_t Ctlrs[CTLR_MAX];
+static int Nctlrs = 0;
+
+/* Network thread side. Rxsrc is in the reactor. */
+static pollsrc_t Rxsrc = { -1, NULL };
+static int Txfd = -1;
+
+/* USB thread side */
+static volatile int Usbfds_changed = 1;
+
+static pthread_t Thread;
+static int Running = 0;
+static volatile int Stop = 0;
+static volatile int Failed = 0;
+
+/* Producer side. Returns -1 if the ring is full. */
+static int usbring_put(usbring_t *r, const unsigned char *data, size_t len)
+{
+    unsigned int head = r->head;
+    usbframe_t *f;
+
+    if ((head - r->tail) == USBRING_SIZE) {
+        r->dropped++;
+        return -1;
+    }
+    if (len > sizeof(f->data)) len = sizeof(f->data);
+    f = &r->slot[head & (USBRING_SIZE - 1)];
+    f->len = len;
+    memcpy(f->data, data, len);
+    __sync_synchronize();
+    r->head = head + 1;
+    return 0;
+}
+
+/* Consumer side. Returns 0 if the ring is empty. */
+static int usbring_get(usbring_t *r, usbframe_t *f)
+{
+    unsigned int tail = r->tail;
+
+    if (tail == r->head) return 0;
+    __sync_synchronize();
+    *f = r->slot[tail & (USBRING_SIZE - 1)];
+    __sync_synchronize();
+    r->tail = tail + 1;
+    return 1;
+}
+
+static void wake(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0) {
+        /* Only fails if the counter is about to overflow, already awake */
+    }
+}
+
+static void unwake(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0) {
+        /* EAGAIN, nothing to clear */
+    }
+}
+
+/**** USB thread ****/
+
+/* user_data is the controller */
+static void IntrOut_cb(struct libusb_transfer *transfer)
+{
+    usbctlr_t *c = &Ctlrs[(intptr_t)transfer->user_data];
+    unsigned char ok;
+
+    /* dbprintf("IntrOut callback len %d\n", transfer->actual_length); */
+    c->outbusy = 0;
+    ok = (transfer->status == LIBUSB_TRANSFER_COMPLETED);
+    if (ok)
+        c->txframes++;
+    else
+        c->txerrors++;
+    /* Windowed frames are done when the controller has taken them */
+    usbring_put(&c->done, &ok, 1);
+    wake(Rxsrc.fd);
+}
+
+/* Give up on an IN transfer. user_data is controller * USBIN_POOL + slot. */
+static void IntrIn_drop(struct libusb_transfer *transfer)
+{
+    int i = (int)(intptr_t)transfer->user_data;
+
+    libusb_free_transfer(transfer);
+    Ctlrs[i / USBIN_POOL].in[i % USBIN_POOL] = NULL;
+}
+
+static void IntrIn_cb(struct libusb_transfer *transfer)
+{
+    usbctlr_t *c = &Ctlrs[(intptr_t)transfer->user_data / USBIN_POOL];
+
+    c->inpending--;
+    if (transfer->status == LIBUSB_TRANSFER_OVERFLOW) {
+        /* Longer than the buffer. Keep the part that fit. */
+        c->rxoverruns++;
+    }
+    else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (!Stop) {
+            dbprintf("IntrIn transfer status %d?\n", transfer->status);
+            Failed = 1;
+            wake(Rxsrc.fd);
+        }
+        IntrIn_drop(transfer);
+        return;
+    }
+    if (c->inpending == 0) c->rxidle++;
+
+    /* dbprintf("IntrIn callback len %d ", transfer->actual_length); */
+    /* hexdump(transfer->buffer, transfer->actual_length); */
+    c->rxframes++;
+    usbring_put(&c->rx, transfer->buffer, transfer->actual_length);
+    if (Stop) {
+        IntrIn_drop(transfer);
+    }
+    else if (libusb_submit_transfer(transfer) < 0) {
+        Failed = 1;
+        IntrIn_drop(transfer);
+    }
+    else {
+        c->inpending++;
+    }
+    wake(Rxsrc.fd);
+}
+
+/* Start the next frame for controller i if its last one is done. Only one
+ * OUT transfer is ever submitted, frames in an RF window wait in the tx
+ * ring. It fails after USBOUT_TIMEOUT_MS so a controller that stops taking
+ * frames does not hold up the rest, and the done ring says so.
+ */
+static void usb_send_next(int i)
+{
+    usbctlr_t *c = &Ctlrs[i];
+    usbframe_t f;
+    unsigned char ok = 0;
+    int r;
+
+    if (c->outbusy || !usbring_get(&c->tx, &f)) return;
+    memcpy(c->outbuf, f.data, f.len);
+    libusb_fill_interrupt_transfer(c->out, c->devh, c->outendpt,
+            c->outbuf, f.len, IntrOut_cb, (void *)(intptr_t)i,
+            USBOUT_TIMEOUT_MS);
+    r = libusb_submit_transfer(c->out);
+    if (r < 0) {
+        dbprintf("IntrOut submit %d\n", r);
+        /* Lost, tell the network thread so the frames after it line up */
+        c->txerrors++;
+        usbring_put(&c->done, &ok, 1);
+        wake(Rxsrc.fd);
+        return;
+    }
+    c->outbusy = 1;
+}
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+    Usbfds_changed = 1;
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+    Usbfds_changed = 1;
+}
+
+/* Wait on the libusb fds and Txfd. libusb may add or drop fds at any time
+ * so the poll set is rebuilt when it says so.
+ */
+static void *usb_thread(void *arg)
+{
+    struct pollfd *fds = NULL;
+    const struct libusb_pollfd **usbfds;
+    struct timeval tv;
+    int nfds = 0, timeout, i;
+
+    while (!Stop && !Failed) {
+        if (Usbfds_changed) {
+            Usbfds_changed = 0;
+            free(fds);
+            usbfds = libusb_get_pollfds(NULL);
+            for (nfds = 0; usbfds && usbfds[nfds]; nfds++)
+                ;
+            fds = calloc(nfds + 1, sizeof(fds[0]));
+            if (fds == NULL) {
+                syslog(LOG_EMERG, "usb thread no memory");
+                free(usbfds);
+                Failed = 1;
+                break;
+            }
+            for (i = 0; i < nfds; i++) {
+                fds[i].fd = usbfds[i]->fd;
+                fds[i].events = usbfds[i]->events;
+            }
+            fds[nfds].fd = Txfd;
+            fds[nfds].events = POLLIN;
+            free(usbfds);
+        }
+        timeout = -1;
+        if (libusb_get_next_timeout(NULL, &tv) == 1)
+            timeout = (tv.tv_sec * 1000) + ((tv.tv_usec + 999) / 1000);
+        if (poll(fds, nfds + 1, timeout) < 0) {
+            if (errno == EINTR) continue;
+            syslog(LOG_EMERG, "usb thread poll %d", errno);
+            Failed = 1;
+            break;
+        }
+        if (fds[nfds].revents & POLLIN) unwake(Txfd);
+        memset(&tv, 0, sizeof(tv));
+        libusb_handle_events_timeout(NULL, &tv);
+        for (i = 0; i < Nctlrs; i++)
+            usb_send_next(i);
+    }
+    free(fds);
+    if (Failed) wake(Rxsrc.fd);
+    return NULL;
+}
+
+/**** Network thread ****/
+
+/* Decode every frame the USB thread has passed over */
+static void usbio_rx_handler(pollsrc_t *src, uint32_t events)
+{
+    usbctlr_t *c;
+    usbframe_t f;
+    static unsigned long dropped[CTLR_MAX];
+    int i;
+
+    unwake(src->fd);
+    for (i = 0; i < Nctlrs; i++) {
+        c = &Ctlrs[i];
+        while (usbring_get(&c->done, &f))
+            x10_sent(i, f.data[0]);
+        while (usbring_get(&c->rx, &f)) {
+            /* if ((f.len == 1) && (f.data[0] == 0x55)) { */
+            if (f.len == 1) {
+                x10_ack(i);
+            }
+            /* Another receiver already heard this RF frame */
+            if (rfmerge_rx(i, c->cm19a, f.data, f.len)) continue;
+            if (c->cm19a)
+                cm19a_decode(-1, f.data, f.len);
+            else
+                cm15a_decode(-1, f.data, f.len);
+        }
+        if (c->rx.dropped != dropped[i]) {
+            dropped[i] = c->rx.dropped;
+            syslog(LOG_WARNING, "usb rx ring full on controller %d, "
+                    "%lu frames dropped", i, dropped[i]);
+        }
+    }
+}
+
+/* Report frames received from each controller and any lost or cut short */
+void usbio_stats(int fd)
+{
+    usbctlr_t *c;
+    int i;
+
+    for (i = 0; i < Nctlrs; i++) {
+        c = &Ctlrs[i];
+        sockprintf(fd, "USB %d rx frames %lu dropped %lu overruns %lu "
+                "idle %lu in flight %d tx frames %lu errors %lu\n", i,
+                c->rxframes, c->rx.dropped, c->rxoverruns, c->rxidle,
+                c->inpending, c->txframes, c->txerrors);
+    }
+}
+
+/* Queue a frame for controller ctlr. Called by x10_write(). */
+int write_usb(int ctlr, unsigned char *buf, size_t len)
+{
+    dbprintf("usb %d len %lu ", ctlr, (unsigned long)len);
+    hexdump(buf, len);
+    if ((ctlr < 0) || (ctlr >= Nctlrs)) return -1;
+    if (usbring_put(&Ctlrs[ctlr].tx, buf, len) < 0) {
+        syslog(LOG_WARNING, "usb tx ring full on controller %d, "
+                "frame dropped", ctlr);
+        return -1;
+    }
+    wake(Txfd);
+    return 0;
+}
+
+/* The USB thread has stopped because a controller went away */
+int usbio_failed(void)
+{
+    return Failed;
+}
+
+/* Set up the transfers for an opened controller. Returns its number for
+ * write_usb(), x10_ack() and x10_sent().
+ */
+int usbio_add(libusb_device_handle *devh, uint8_t inendpt, uint8_t outendpt,
+        int cm19a)
+{
+    usbctlr_t *c;
+    int i;
+
+    if (Running || (Nctlrs == CTLR_MAX)) return -EBUSY;
+    c = &Ctlrs[Nctlrs];
+    c->devh = devh;
+    c->inendpt = inendpt;
+    c->outendpt = outendpt;
+    c->cm19a = cm19a;
+    for (i = 0; i < USBIN_POOL; i++) {
+        c->in[i] = libusb_alloc_transfer(0);
+        if (!c->in[i])
+            return -ENOMEM;
+        libusb_fill_interrupt_transfer(c->in[i], devh, inendpt,
+                c->inbuf[i], sizeof(c->inbuf[i]), IntrIn_cb,
+                (void *)(intptr_t)(Nctlrs * USBIN_POOL + i), 0);
+    }
+    c->out = libusb_alloc_transfer(0);
+    if (!c->out)
+        return -ENOMEM;
+    return Nctlrs++;
+}
+
+/* Start reading from every controller and hand them to the USB thread */
+int usbio_start(void)
+{
+    sigset_t all, old;
+    usbctlr_t *c;
+    int i, j, r;
+
+    Rxsrc.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    Txfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if ((Rxsrc.fd < 0) || (Txfd < 0)) return -errno;
+    Rxsrc.handler = usbio_rx_handler;
+    if (reactor_add(&Rxsrc, EPOLLIN) < 0) return -errno;
+
+    for (i = 0; i < Nctlrs; i++) {
+        c = &Ctlrs[i];
+        for (j = 0; j < USBIN_POOL; j++) {
+            r = libusb_submit_transfer(c->in[j]);
+            if (r < 0)
+                return r;
+            c->inpending++;
+        }
+    }
+
+    libusb_set_pollfd_notifiers(NULL, usb_pollfd_added, usb_pollfd_removed,
+            NULL);
+    /* Signals go to the network thread so they interrupt the reactor */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    r = pthread_create(&Thread, NULL, usb_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0) {
+        syslog(LOG_EMERG, "usb thread pthread_create %d", r);
+        return -r;
+    }
+    Running = 1;
+    return 0;
+}
+
+/* Transfers still with libusb on any controller */
+static int usbio_busy(void)
+{
+    int i;
+
+    for (i = 0; i < Nctlrs; i++)
+        if (Ctlrs[i].outbusy || (Ctlrs[i].inpending > 0)) return 1;
+    return 0;
+}
+
+/* Stop the USB thread, then cancel the transfers from this thread */
+void usbio_stop(void)
+{
+    usbctlr_t *c;
+    int i, j, busy;
+
+    if (Running) {
+        Stop = 1;
+        wake(Txfd);
+        pthread_join(Thread, NULL);
+        Running = 0;
+    }
+    libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+
+    Stop = 1;
+    for (i = 0; i < Nctlrs; i++) {
+        c = &Ctlrs[i];
+        if (c->out && c->outbusy)
+            libusb_cancel_transfer(c->out);
+        for (j = 0; j < USBIN_POOL; j++)
+            if (c->in[j])
+                libusb_cancel_transfer(c->in[j]);
+    }
+    i = 100;
+    while (usbio_busy() && i--)
+        if (libusb_handle_events(NULL) < 0)
+            break;
+
+    /* Never submitted, or stuck. Freeing one still queued is not safe. */
+    busy = usbio_busy();
+    for (i = 0; i < Nctlrs; i++) {
+        c = &Ctlrs[i];
+        for (j = 0; j < USBIN_POOL; j++) {
+            if (c->in[j] && !busy)
+                libusb_free_transfer(c->in[j]);
+            c->in[j] = NULL;
+        }
+        if (!busy) libusb_free_transfer(c->out);
+        c->out = NULL;
+    }
+    Nctlrs = 0;
+    if (Rxsrc.fd >= 0) {
+        reactor_del(&Rxsrc);
+        close(Rxsrc.fd);
+        Rxsrc.fd = -1;
+    }
+    if (Txfd >= 0) {
+        close(Txfd);
+        Txfd = -1;
+    }
+}
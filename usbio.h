@@ -0,0 +1,49 @@
+/*
+ * Copyright 2010-2011 Brian Uechi <buasst@gmail.com>
+ *
+ * This file is part of mochad.
+ *
+ * mochad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mochad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USBIO_H
+#define USBIO_H
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+/* USB I/O thread. Once started it owns the device handles and the
+ * interrupt transfers of every controller added with usbio_add(). Frames
+ * from a controller are passed to the network thread, which decodes them,
+ * through a single producer/single consumer ring per controller and an
+ * eventfd in the reactor. Frames for a controller go the other way
+ * through write_usb().
+ */
+
+#define USBRING_SIZE    (256)   /* Frames per ring, power of 2 */
+#define USBIN_POOL      (4)     /* Interrupt IN transfers kept submitted */
+#define USBOUT_TIMEOUT_MS (2000) /* Give up on an OUT transfer */
+
+int usbio_add(libusb_device_handle *devh, uint8_t inendpt, uint8_t outendpt,
+        int cm19a);
+
+int usbio_start(void);
+
+int usbio_failed(void);
+
+void usbio_stop(void);
+
+void usbio_stats(int fd);
+
+#endif
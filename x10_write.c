@@ -17,9 +17,12 @@
  * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* CM15A output FIFO
+/* CM15A output queue
  * X10 I/O is very slow so store up pending output then wait for X10ACK
  * (0x55) before sending the next item from the queue.
+ * Each origin (client connection, the AMQP receiver, or mochad itself) has
+ * its own queue of whole commands, in the PL or the RF lane. Clients are
+ * told as their commands are queued, sent, and acknowledged.
  */
 
 #include <stdio.h>
@@ -27,74 +30,1667 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include "global.h"
 #include "x10_write.h"
+#include "client.h"
+#include "rfmerge.h"
 
+#define OUT_FIRST       (0x01)  /* First frame of a command */
+#define OUT_LAST        (0x02)  /* Last frame of a command */
+#define OUT_JOINED      (0x04)  /* Address batched into another command */
+
+#define OUT_NONE        (-1)    /* End of a frame list */
+
+#define ORIGIN_MAX      (32)    /* Origins with frames queued at once */
+#define ORIGIN_QUOTA    (64)    /* Frames queued per origin, at least */
+#define OUT_MIN         (64)    /* Frames allocated at start */
+#define DRR_QUANTUM     (2)     /* Frames per round, PL address + function */
+
+/* Each PL address or function code is 11 AC cycles, sent twice, plus a
+ * 3 cycle gap. 25 cycles at 60 Hz.
+ */
+#define PL_FRAME_MS     (417)
+#define PL_DIMSTEP_MS   (183)   /* One more function code, 11 cycles */
+#define PLX_FRAME_MS    (1083)  /* Extended code, 31 cycles twice plus gap */
+#define RF_FRAME_MS     (200)   /* RF frame sent 5 times */
+
+#define COAL_MAX        (32)    /* Commands looked at per new command */
+#define DIMS_MAX        (31)    /* Largest dim/bright step in one frame */
+#define JOIN_MAX        (16)    /* Commands batched into one, a house */
+#define RFWINDOW_PROBE  (32)    /* Frames taken in time to reopen a window */
+
+#define ACK_BUCKET_MS   (20)    /* Histogram bucket width */
+#define ACK_BUCKETS     (100)   /* Up to ACK_MAX_MS, then one for later */
+#define ACK_MAX_MS      (2000)  /* Timeout before enough samples */
+#define ACK_MIN_MS      (100)
+#define ACK_MARGIN_MS   (100)   /* Added to p99 */
+#define ACK_MINSAMPLES  (20)    /* Samples needed to adapt */
+#define ACK_WINDOW      (1000)  /* Counts are halved at this many samples */
+
+/* Kinds of frame with their own ACK latency */
+#define ACK_PL          (0)     /* PL address or function */
+#define ACK_PLX         (1)     /* PL extended code */
+#define ACK_RF          (2)     /* RF standard */
+#define ACK_RFX         (3)     /* RF security or camera */
+#define ACK_CLASSES     (4)
+
+#define LANE_PL         (0)
+#define LANE_RF         (1)
+#define LANE_MAX        (2)
 
 typedef struct x10out {
+    int next;                   /* Next frame in the same list */
     size_t outlen;
     unsigned char outdata[8];
+    uint32_t cmdid;             /* 0 if not part of a client command */
+    int fd;                     /* Client that sent the command */
+    uint32_t serial;            /* Tells a reused fd from the original */
+    uint64_t queuedus;          /* When the command was queued */
+    uint64_t deadline;          /* Drop if not started by then, 0 never */
+    uint64_t sentus;            /* When its command started */
+    int flags;                  /* OUT_* */
+    int lane;                   /* LANE_* */
+    unsigned char plop;         /* PLOP_*, 0 if not coalesced */
+    unsigned char addressed;    /* house and unit are set */
+    unsigned char house, unit, dims;    /* unit 0xFF for the whole house */
+    unsigned char njoined;      /* Addresses batched before this frame */
+    unsigned char ackclass;     /* ACK_* */
+    int airms;                  /* Estimated time to send and ACK */
 } x10out_t;
 
-static x10out_t Outrecs[256];
-#define OUTPTRSSIZE             (sizeof(Outrecs)/sizeof(Outrecs[0]))
-static int Outhead = 0;
-static int Outtail = 0;
-static int Outbusy = 0;
+/* Frames queued by one client, or by mochad itself */
+typedef struct origin {
+    int fd;                     /* -1 for mochad itself */
+    uint32_t serial;
+    int head, tail;             /* Frames in order */
+    int nframes;
+    int deficit;                /* Frames it may still send this round */
+    int inturn;                 /* Quantum added for this round */
+    int active;                 /* On its lane's active list */
+    int sending;                /* A controller is sending its command */
+    int inflight;               /* Frames written and not done yet */
+    int ctlr;                   /* Controller they were written to */
+    int lane;
+    struct origin *next;
+} origin_t;
+
+typedef struct lane {
+    const char *name;
+    origin_t *active, *activetail;  /* Origins with frames, DRR order */
+    origin_t self;              /* mochad itself, and overflow */
+    int nframes;                /* Frames queued */
+    long airms;                 /* Estimated airtime of frames queued */
+    unsigned long frames;       /* Frames sent */
+    unsigned long acked;
+    unsigned long timeouts;
+    unsigned long dropped;      /* Frames lost to a full queue */
+    unsigned long droppedcmds;
+    unsigned long expired;      /* Commands past their deadline */
+    unsigned long expiredframes;
+    unsigned long cancelled;    /* Commands removed by QUEUE CANCEL */
+    unsigned long coalesced;    /* Commands cancelled or merged */
+    unsigned long framesaved;   /* Frames they would have sent */
+    unsigned long batched;      /* Commands sharing a function frame */
+    unsigned long rejected;     /* Commands turned away by x10_admit() */
+    unsigned long waits;        /* Commands started */
+    uint64_t waitus;            /* Total time from queued to started */
+    uint64_t maxwaitus;
+} lane_t;
+
+/* ACK latency for one kind of frame */
+typedef struct ackhist {
+    const char *name;
+    unsigned long count[ACK_BUCKETS + 1];   /* Last is timed out */
+    unsigned long samples;      /* Sum of count[], decays */
+    unsigned long acked;        /* Totals, do not decay */
+    unsigned long timeouts;
+    int timeoutms;              /* Current timeout */
+} ackhist_t;
+
+/* A frame written to a controller and not done yet */
+typedef struct inflight {
+    int idx;
+    origin_t *origin;           /* NULL for setup frames */
+    uint64_t sentus;            /* When it was written */
+    uint64_t deadline;          /* When to give up on it */
+    int windowed;               /* Done when the USB OUT transfer is */
+    uint32_t seq;               /* USB write number, 0 if not written */
+} inflight_t;
+
+/* One controller's frames in flight, oldest first, and the commands they
+ * belong to. The command being written is on the sending side, the one
+ * whose frames are being completed on the other, they only differ when
+ * frames are windowed.
+ */
+typedef struct ctlrtx {
+    int present;
+    int cm19a;                  /* RF only */
+    int setuphead, setuptail;   /* Frames for this controller only */
+    inflight_t flight[RFWINDOW_MAX];
+    int flhead;                 /* Oldest in flight[] */
+    int nflight;                /* Frames written, not done */
+    int window;                 /* Frames it may have in flight */
+    int probe;                  /* Frames taken in time since fallback */
+    unsigned long fallbacks;    /* Times the window closed */
+    uint64_t timedoutus;        /* Last ACK timeout, 0 once an ACK came */
+    uint32_t txseq;             /* Frames written to USB */
+    uint32_t doneseq;           /* OUT transfers finished */
+    origin_t *origin;           /* Origin of the command being sent */
+    uint64_t sentus;            /* When the command being sent started */
+    int failed;                 /* Command being completed timed out */
+    x10out_t cmd;
+    x10out_t joined[JOIN_MAX];  /* Commands batched into it */
+    int njoined;
+    unsigned long frames;       /* Frames sent */
+    ackhist_t acks[ACK_CLASSES];
+} ctlrtx_t;
+
+lanepolicy_t LanePolicy = LANE_RFFIRST;
+int MaxLatency = 0;
+int RfWindow = 4;
+int TxQueueMax = 256;
+overflow_t TxOverflow = OVERFLOW_REJECT;
+
+static x10out_t *Outrecs = NULL;
+static int Outsize = 0;             /* Frames allocated */
+static int Outfree = OUT_NONE;
+static int Nfree = 0;
+static int Quota = ORIGIN_QUOTA;    /* Frames per origin */
+
+static origin_t Origins[ORIGIN_MAX];
+static lane_t Lanes[LANE_MAX] = { { "PL" }, { "RF" } };
+static lane_t *Lastlane = NULL;
+static const char *Ackname[ACK_CLASSES] = { "PL", "PLX", "RF", "RFX" };
+static const char *Overflowname[] = { "reject", "drop-oldest", "block" };
+
+static ctlrtx_t Ctlrs[CTLR_MAX];
+static int Nctlrs = 0;              /* Controllers present */
+static ctlrtx_t *Plctlr = NULL;     /* Sends all PL frames */
+
+/* Command being queued by x10_cmd_begin() */
+static x10out_t Newcmd;
+static int Lastout = OUT_NONE;
+static int Incmd = 0;
+static int Newdropped = 0;          /* A frame did not fit, drop the rest */
+static int Newfirst = OUT_NONE;
+static origin_t *Neworigin = NULL;
+
+static int frame_ms(const x10out_t *rec);
+static int drop_oldest(origin_t *o);
+
+/* Make the frame pool bigger, up to TxQueueMax. Returns -1 if it cannot
+ * grow.
+ */
+static int outrecs_grow(void)
+{
+    x10out_t *recs;
+    int i, size;
+
+    size = (Outsize) ? Outsize * 2 : OUT_MIN;
+    if (size > TxQueueMax) size = TxQueueMax;
+    if (size <= Outsize) return -1;
+    recs = realloc(Outrecs, size * sizeof(*recs));
+    if (recs == NULL) {
+        syslog(LOG_WARNING, "no memory to grow output queue to %d frames",
+                size);
+        return -1;
+    }
+    Outrecs = recs;
+    for (i = size - 1; i >= Outsize; i--) {
+        Outrecs[i].next = Outfree;
+        Outfree = i;
+    }
+    Nfree += size - Outsize;
+    dbprintf("output queue %d frames\n", size);
+    Outsize = size;
+    return 0;
+}
+
+/* Take a frame from the pool, growing it if need be. OUT_NONE if full. */
+static int alloc_x10out(void)
+{
+    int idx;
+
+    if ((Outfree == OUT_NONE) && (outrecs_grow() < 0)) return OUT_NONE;
+    idx = Outfree;
+    Outfree = Outrecs[idx].next;
+    Nfree--;
+    return idx;
+}
+
+static void outrecs_init(void)
+{
+    static int done = 0;
+    int i;
+
+    if (done) return;
+    done = 1;
+    if (TxQueueMax < DRR_QUANTUM) TxQueueMax = DRR_QUANTUM;
+    Quota = TxQueueMax / 4;
+    if (Quota < ORIGIN_QUOTA) Quota = ORIGIN_QUOTA;
+    if (Quota > TxQueueMax) Quota = TxQueueMax;
+    outrecs_grow();
+    for (i = 0; i < ORIGIN_MAX; i++) {
+        Origins[i].head = Origins[i].tail = OUT_NONE;
+    }
+    for (i = 0; i < LANE_MAX; i++) {
+        Lanes[i].self.fd = -1;
+        Lanes[i].self.lane = i;
+        Lanes[i].self.head = Lanes[i].self.tail = OUT_NONE;
+    }
+}
+
+/* Queue for frames from fd in lane. NULL if fd has nothing queued there and
+ * create is 0.
+ */
+static origin_t *origin_find(int fd, uint32_t serial, int lane, int create)
+{
+    origin_t *o, *spare = NULL;
+    int i;
+
+    if (fd < 0) return &Lanes[lane].self;
+    for (i = 0; i < ORIGIN_MAX; i++) {
+        o = &Origins[i];
+        if ((o->nframes == 0) && !o->sending && !o->active &&
+                !o->inflight) {
+            if (spare == NULL) spare = o;
+        }
+        else if ((o->fd == fd) && (o->serial == serial) && (o->lane == lane))
+            return o;
+    }
+    if (!create) return NULL;
+    if (spare == NULL) {
+        dbprintf("origin table full, fd %d shares the mochad queue\n", fd);
+        return &Lanes[lane].self;
+    }
+    spare->fd = fd;
+    spare->serial = serial;
+    spare->lane = lane;
+    spare->deficit = 0;
+    spare->inturn = 0;
+    return spare;
+}
 
-static int next_index(int idx)
+static void cmd_notify(const x10out_t *rec, cmdstate_t state, uint64_t sentus)
 {
-    return ((idx + 1) % OUTPTRSSIZE);
+    uint64_t now;
+
+    if ((rec->cmdid == 0) || (rec->fd < 0)) return;
+    now = monotonic_us();
+    client_cmd_notify(rec->fd, rec->serial, rec->cmdid, state,
+            (sentus) ? (sentus - rec->queuedus) : 0, now - rec->queuedus);
 }
 
-static int add_x10out(unsigned char *buf, size_t buflen)
+/* Queue one frame of the command being built at the tail of o. The pool
+ * grows up to TxQueueMax (--tx-queue) frames and o may have a quarter of
+ * them, at least ORIGIN_QUOTA. When a frame still does not fit TxOverflow
+ * says whether to drop the oldest waiting command to make room. Otherwise
+ * the frame, and so the whole command, is dropped. With --tx-overflow block
+ * client_hold() stops reading commands before it gets that far.
+ */
+static int add_x10out(origin_t *o, unsigned char *buf, size_t buflen)
 {
-    int nxt;
-    x10out_t *nxtrec;
+    lane_t *lane = &Lanes[o->lane];
+    int idx = OUT_NONE;
+    x10out_t *rec;
 
     dbprintf("len %lu\n", buflen);
-    if ((nxt = next_index(Outtail)) == Outhead) {
-        dbprintf("Outptrs full Outhead/tail %d/%d\n", Outhead, Outtail);
-        return -1;
+    for (;;) {
+        if (o->nframes < Quota) idx = alloc_x10out();
+        if (idx != OUT_NONE) break;
+        if ((TxOverflow != OVERFLOW_DROPOLDEST) ||
+                (drop_oldest((o->nframes < Quota) ? NULL : o) < 0)) {
+            dbprintf("Outrecs full, fd %d has %d of %d free\n", o->fd,
+                    o->nframes, Nfree);
+            syslog(LOG_WARNING, "%s output queue full for %s %d, frame "
+                    "dropped", lane->name, (o->fd < 0) ? "mochad" : "client",
+                    o->fd);
+            lane->dropped++;
+            return -1;
+        }
     }
 
-    nxtrec = &Outrecs[nxt];
-    nxtrec->outlen = buflen;
-    memcpy(nxtrec->outdata, buf, buflen);
-    Outtail = nxt;
+    rec = &Outrecs[idx];
+    *rec = Newcmd;
+    rec->next = OUT_NONE;
+    rec->lane = o->lane;
+    rec->outlen = buflen;
+    memcpy(rec->outdata, buf, buflen);
+    rec->airms = frame_ms(rec);
+    if (o->tail == OUT_NONE)
+        o->head = idx;
+    else
+        Outrecs[o->tail].next = idx;
+    o->tail = idx;
+    o->nframes++;
+    lane->nframes++;
+    lane->airms += rec->airms;
+    if (!o->active) {
+        o->active = 1;
+        o->next = NULL;
+        if (lane->activetail)
+            lane->activetail->next = o;
+        else
+            lane->active = o;
+        lane->activetail = o;
+    }
+    Lastout = idx;
+    if (rec->flags & OUT_FIRST) {
+        Newfirst = idx;
+        Neworigin = o;
+    }
     return buflen;
 }
 
-int send_next_x10out(void)
+static int take_x10out(origin_t *o)
+{
+    int idx = o->head;
+
+    o->head = Outrecs[idx].next;
+    if (o->head == OUT_NONE) o->tail = OUT_NONE;
+    Outrecs[idx].next = OUT_NONE;
+    o->nframes--;
+    o->deficit--;
+    Lanes[o->lane].nframes--;
+    Lanes[o->lane].airms -= Outrecs[idx].airms;
+    return idx;
+}
+
+static void free_x10out(int idx)
+{
+    Outrecs[idx].next = Outfree;
+    Outfree = idx;
+    Nfree++;
+}
+
+/* kth oldest frame c has in flight */
+static inflight_t *flight(ctlrtx_t *c, int k)
+{
+    return &c->flight[(c->flhead + k) % RFWINDOW_MAX];
+}
+
+/* Frame idx has been written to a controller */
+static int in_flight(int idx)
+{
+    int i, k;
+
+    for (i = 0; i < CTLR_MAX; i++)
+        for (k = 0; k < Ctlrs[i].nflight; k++)
+            if (flight(&Ctlrs[i], k)->idx == idx) return 1;
+    return 0;
+}
+
+/* Remove the command starting at frame first from o. It has not started.
+ * The client, and those of commands batched into it, are told why.
+ */
+static void remove_cmd(origin_t *o, int first, cmdstate_t why)
 {
-    x10out_t *outrec;
+    lane_t *lane = &Lanes[o->lane];
+    int idx, prev = OUT_NONE, next, n = 0;
 
-    if (Outbusy) {
-        dbprintf("Outhead Outtail %d/%d\n", Outhead, Outtail);
-        if (Outhead == Outtail) {
-            /* Empty */
-            Outbusy = 0;
-            PollTimeOut = -1;
+    for (idx = o->head; (idx != OUT_NONE) && (idx != first);
+            idx = Outrecs[idx].next)
+        prev = idx;
+    if (idx == OUT_NONE) return;
+    cmd_notify(&Outrecs[first], why, 0);
+    do {
+        next = Outrecs[idx].next;
+        if (Outrecs[idx].flags & OUT_JOINED) {
+            cmd_notify(&Outrecs[idx], why, 0);
+            if (why == CMD_EXPIRED) lane->expired++;
         }
-        else {
-            Outhead = next_index(Outhead);
-            outrec = &Outrecs[Outhead];
-            write_usb(outrec->outdata, outrec->outlen);
+        lane->airms -= Outrecs[idx].airms;
+        free_x10out(idx);
+        n++;
+        idx = next;
+    } while ((idx != OUT_NONE) && !(Outrecs[idx].flags & OUT_FIRST));
+    if (prev == OUT_NONE)
+        o->head = idx;
+    else
+        Outrecs[prev].next = idx;
+    if (idx == OUT_NONE) o->tail = prev;
+    o->nframes -= n;
+    lane->nframes -= n;
+    if (why == CMD_EXPIRED) {
+        lane->expired++;
+        lane->expiredframes += n;
+    }
+    else if (why == CMD_CANCELLED)
+        lane->cancelled++;
+    else if (why == CMD_DROPPED) {
+        lane->droppedcmds++;
+        lane->dropped += n;
+    }
+    else {
+        lane->coalesced++;
+        lane->framesaved += n;
+    }
+}
+
+/* Take the single frame idx out of o and free it */
+static void unlink_frame(origin_t *o, int idx)
+{
+    lane_t *lane = &Lanes[o->lane];
+    int i, prev = OUT_NONE;
+
+    for (i = o->head; (i != OUT_NONE) && (i != idx); i = Outrecs[i].next)
+        prev = i;
+    if (i == OUT_NONE) return;
+    if (prev == OUT_NONE)
+        o->head = Outrecs[idx].next;
+    else
+        Outrecs[prev].next = Outrecs[idx].next;
+    if (o->tail == idx) o->tail = prev;
+    o->nframes--;
+    lane->nframes--;
+    lane->airms -= Outrecs[idx].airms;
+    free_x10out(idx);
+}
+
+/* Make room by dropping the oldest waiting command, from o only if o is not
+ * NULL. The command being queued is kept. Returns -1 if there is nothing
+ * to drop.
+ */
+static int drop_oldest(origin_t *o)
+{
+    origin_t *oo, *from = NULL;
+    x10out_t *rec;
+    int i, l, idx, oldest = OUT_NONE;
+
+    for (l = 0; l < LANE_MAX; l++) {
+        for (i = -1; i < ORIGIN_MAX; i++) {
+            oo = (i < 0) ? &Lanes[l].self : &Origins[i];
+            if ((oo->nframes == 0) || (oo->lane != l)) continue;
+            if (o && (oo != o)) continue;
+            for (idx = oo->head; idx != OUT_NONE; idx = rec->next) {
+                rec = &Outrecs[idx];
+                if (!(rec->flags & OUT_FIRST) || (idx == Newfirst)) continue;
+                if ((oldest == OUT_NONE) ||
+                        (rec->queuedus < Outrecs[oldest].queuedus)) {
+                    oldest = idx;
+                    from = oo;
+                }
+            }
         }
     }
+    if (oldest == OUT_NONE) return -1;
+    syslog(LOG_NOTICE, "output queue full, dropped command %u from %s %d",
+            Outrecs[oldest].cmdid, (from->fd < 0) ? "mochad" : "client",
+            Outrecs[oldest].fd);
+    remove_cmd(from, oldest, CMD_DROPPED);
     return 0;
 }
 
-int x10_write(unsigned char *buf, size_t buflen)
+/* Cancel the waiting command whose first or batched address frame is idx
+ * in o. Commands batched into it stay queued.
+ */
+static void cancel_cmd(origin_t *o, int idx)
+{
+    x10out_t *rec = &Outrecs[idx], *nx = NULL, *fn;
+    int f;
+
+    if (!(rec->flags & OUT_JOINED) && ((rec->next == OUT_NONE) ||
+            !(Outrecs[rec->next].flags & OUT_JOINED))) {
+        remove_cmd(o, idx, CMD_CANCELLED);
+        return;
+    }
+    for (f = rec->next; (f != OUT_NONE) && !(Outrecs[f].flags & OUT_LAST);
+            f = Outrecs[f].next)
+        ;
+    if (f == OUT_NONE) return;
+    fn = &Outrecs[f];
+    if (!(rec->flags & OUT_JOINED)) {
+        /* The next address leads the batch and owns the function frame */
+        nx = &Outrecs[rec->next];
+        nx->flags = OUT_FIRST;
+        nx->deadline = rec->deadline;
+        fn->cmdid = nx->cmdid;
+        fn->fd = nx->fd;
+        fn->serial = nx->serial;
+        fn->queuedus = nx->queuedus;
+    }
+    if (fn->njoined) fn->njoined--;
+    /* Still a batch, never coalesce it, see join() */
+    if (nx && fn->njoined) nx->plop = 0;
+    cmd_notify(rec, CMD_CANCELLED, 0);
+    Lanes[o->lane].cancelled++;
+    unlink_frame(o, idx);
+}
+
+/* Does a new op make an earlier unstarted op for the same unit redundant */
+static int supersedes(int newop, int oldop)
+{
+    switch (newop) {
+        case PLOP_ON:
+            return (oldop == PLOP_ON) || (oldop == PLOP_OFF);
+        case PLOP_OFF:
+        case PLOP_XDIM:
+            return 1;
+    }
+    return 0;
+}
+
+/* The PL command starting at frame newidx in o was just queued. Cancel or
+ * merge earlier commands it makes redundant. An ON or OFF cancels earlier
+ * ONs and OFFs for the same unit, an OFF or XDIM also earlier DIMs and
+ * BRIGHTs, and a DIM or BRIGHT right after another in the same direction
+ * is folded into it. Cancelling stops at the first command still needed,
+ * so the end result on the powerline is the same.
+ */
+static int coalesce(origin_t *o, int newidx)
+{
+    struct {
+        origin_t *o;
+        int idx;
+    } found[COAL_MAX], t;
+    x10out_t *nw = &Outrecs[newidx], *rec;
+    lane_t *lane = &Lanes[nw->lane];
+    origin_t *oo;
+    int nfound = 0, i, j, idx, dims;
+
+    /* Earlier unstarted commands for the same unit, newest first. Command
+     * ids are given out in order.
+     */
+    for (i = -1; i < ORIGIN_MAX; i++) {
+        oo = (i < 0) ? &lane->self : &Origins[i];
+        if ((oo->nframes == 0) || (oo->lane != nw->lane)) continue;
+        for (idx = oo->head; idx != OUT_NONE; idx = rec->next) {
+            rec = &Outrecs[idx];
+            if (!(rec->flags & OUT_FIRST) || (rec->plop == 0) ||
+                    (idx == newidx) || (rec->cmdid >= nw->cmdid) ||
+                    (rec->house != nw->house) || (rec->unit != nw->unit))
+                continue;
+            if (nfound == COAL_MAX) break;
+            for (j = nfound++; (j > 0) &&
+                    (Outrecs[found[j-1].idx].cmdid < rec->cmdid); j--)
+                found[j] = found[j-1];
+            found[j].o = oo;
+            found[j].idx = idx;
+        }
+    }
+    if (nfound == 0) return 0;
+
+    if ((nw->plop == PLOP_DIM) || (nw->plop == PLOP_BRIGHT)) {
+        /* Fold into the previous step in the same direction. The function
+         * frame is 06 <house|func> <dims << 3 | 06>, see pl_tx_housefunc().
+         */
+        rec = &Outrecs[found[0].idx];
+        dims = rec->dims + nw->dims;
+        if ((rec->plop != nw->plop) || (dims > DIMS_MAX) ||
+                (rec->next == OUT_NONE)) return 0;
+        rec->dims = dims;
+        Outrecs[rec->next].outdata[2] = (dims << 3) | 0x06;
+        lane->airms -= Outrecs[rec->next].airms;
+        Outrecs[rec->next].airms = frame_ms(&Outrecs[rec->next]);
+        lane->airms += Outrecs[rec->next].airms;
+        remove_cmd(o, newidx, CMD_COALESCED);
+        return 1;
+    }
+    for (i = 0; i < nfound; i++) {
+        t = found[i];
+        if (!supersedes(nw->plop, Outrecs[t.idx].plop)) break;
+        remove_cmd(t.o, t.idx, CMD_COALESCED);
+    }
+    return 0;
+}
+
+/* Batch the PL command starting at frame newidx in o, an address frame
+ * then a function frame, into the newest waiting command with the same
+ * function frame. X10 lets addresses in one house share a function code,
+ * so A1 ON, A2 ON, A3 ON goes out as A1 A2 A3 A-ON. Only o's own commands
+ * are looked at. Another origin's next command may be about to go out on
+ * a controller, and joining it would not save anyone a DRR round. The new
+ * command is not moved past a waiting command for the same unit, or one
+ * whose target is unknown.
+ */
+static void join(origin_t *o, int newidx)
+{
+    x10out_t *nw = &Outrecs[newidx], *fn, *rec;
+    lane_t *lane = &Lanes[nw->lane];
+    int idx, prev, started, target = OUT_NONE;
+    uint32_t newest;
+
+    if ((nw->plop == PLOP_XDIM) || (nw->outlen != 2) ||
+            (nw->next == OUT_NONE)) return;
+    fn = &Outrecs[nw->next];
+    if (!(fn->flags & OUT_LAST) || (fn->next != OUT_NONE)) return;
+
+    /* Newest waiting function frame that matches, not in the rest of the
+     * command a controller is sending
+     */
+    started = o->sending;
+    for (idx = o->head; idx != OUT_NONE; idx = rec->next) {
+        rec = &Outrecs[idx];
+        if (rec->flags & OUT_FIRST) started = 0;
+        if (started) continue;
+        if ((rec->flags & OUT_LAST) && (rec->plop == nw->plop) &&
+                (rec->cmdid != 0) && (rec->cmdid < nw->cmdid) &&
+                (rec->outlen == fn->outlen) &&
+                !memcmp(rec->outdata, fn->outdata, fn->outlen) &&
+                (rec->njoined < JOIN_MAX))
+            target = idx;
+    }
+    if (target == OUT_NONE) return;
+    newest = Outrecs[target].cmdid;
+
+    /* Do not move ahead of a waiting command for the same unit, or one
+     * mochad queued on its own
+     */
+    for (idx = Outrecs[target].next; idx != newidx; idx = rec->next) {
+        rec = &Outrecs[idx];
+        if (!(rec->flags & OUT_FIRST)) continue;
+        if ((rec->cmdid == 0) || (rec->plop == 0) ||
+                ((rec->house == nw->house) && (rec->unit == nw->unit)))
+            return;
+    }
+
+    /* The new command is the tail of o */
+    prev = OUT_NONE;
+    for (idx = o->head; idx != newidx; idx = Outrecs[idx].next)
+        prev = idx;
+    if (prev == OUT_NONE)
+        o->head = OUT_NONE;
+    else
+        Outrecs[prev].next = OUT_NONE;
+    o->tail = prev;
+    o->nframes -= 2;
+    lane->airms -= Outrecs[nw->next].airms;
+    free_x10out(nw->next);
+    lane->nframes--;
+
+    /* Address goes right before the target function frame */
+    prev = OUT_NONE;
+    for (idx = o->head; idx != target; idx = Outrecs[idx].next)
+        prev = idx;
+    if (prev == OUT_NONE)
+        o->head = newidx;
+    else
+        Outrecs[prev].next = newidx;
+    nw->next = target;
+    nw->flags = OUT_JOINED;
+    o->nframes++;
+    Outrecs[target].njoined++;
+    /* The target now addresses several units, do not coalesce it. It
+     * lives as long as the longest lived of them.
+     */
+    for (idx = o->head; idx != OUT_NONE; idx = Outrecs[idx].next) {
+        rec = &Outrecs[idx];
+        if (!(rec->flags & OUT_FIRST) || (rec->cmdid != newest)) continue;
+        rec->plop = 0;
+        if ((rec->deadline == 0) || (nw->deadline == 0))
+            rec->deadline = 0;
+        else if (nw->deadline > rec->deadline)
+            rec->deadline = nw->deadline;
+    }
+    lane->batched++;
+}
+
+/* Last frame of the command c is completing is done */
+static void joined_done(ctlrtx_t *c)
+{
+    int i;
+
+    for (i = 0; i < c->njoined; i++)
+        cmd_notify(&c->joined[i], (c->failed) ? CMD_TIMEOUT : CMD_ACKED,
+                c->joined[i].sentus);
+    c->njoined = 0;
+}
+
+/* Lane for c to start the next command from, NULL if c has nothing to
+ * send. RF frames wait apart from PL ones so RF commands and camera moves
+ * are not stuck behind a run of PL dims. Only the first CM15A sends PL so
+ * two controllers never talk over each other on the powerline.
+ */
+static lane_t *lane_pick(const ctlrtx_t *c)
+{
+    lane_t *pl = &Lanes[LANE_PL], *rf = &Lanes[LANE_RF];
+
+    if ((c != Plctlr) || (pl->nframes == 0))
+        return (rf->nframes) ? rf : NULL;
+    if (rf->nframes == 0) return pl;
+    if (LanePolicy == LANE_RFFIRST) return rf;
+    /* Take turns, one command each */
+    Lastlane = (Lastlane == rf) ? pl : rf;
+    return Lastlane;
+}
+
+static void active_unlink(lane_t *lane, origin_t *prev, origin_t *o)
 {
-    dbprintf("Outbusy=%d\n", Outbusy);
-    if (Outbusy) {
-        add_x10out(buf, buflen);
+    if (prev)
+        prev->next = o->next;
+    else
+        lane->active = o->next;
+    if (lane->activetail == o) lane->activetail = prev;
+    o->next = NULL;
+}
+
+/* Next command for c from lane by deficit round robin over the origins
+ * that are not already sending, or still have frames in flight, on another
+ * controller. Whole commands are taken, DRR_QUANTUM frames per origin per
+ * round, so a long run from one client delays someone else's command by
+ * one round at most. An origin sends one command at a time, on one
+ * controller, so its commands go out in order. A command past the deadline
+ * from its TTL is dropped instead.
+ */
+static int lane_next(ctlrtx_t *c, lane_t *lane)
+{
+    origin_t *o = lane->active, *prev = NULL;
+    x10out_t *rec;
+    uint64_t now = monotonic_us();
+
+    while (o != NULL) {
+        if (o->sending || (o->inflight && (o->ctlr != c - Ctlrs))) {
+            prev = o;
+            o = o->next;
+            continue;
+        }
+        if (o->nframes == 0) {
+            /* Idle origins start the next busy period with no credit */
+            active_unlink(lane, prev, o);
+            o->active = 0;
+            o->deficit = 0;
+            o->inturn = 0;
+            o = (prev) ? prev->next : lane->active;
+            continue;
+        }
+        /* Too late to be of use, drop it instead of sending it */
+        rec = &Outrecs[o->head];
+        if ((rec->flags & OUT_FIRST) && rec->deadline &&
+                (now >= rec->deadline)) {
+            remove_cmd(o, o->head, CMD_EXPIRED);
+            continue;
+        }
+        if (!o->inturn) {
+            o->deficit += DRR_QUANTUM;
+            o->inturn = 1;
+        }
+        if (o->deficit > 0) {
+            o->sending = 1;
+            o->ctlr = c - Ctlrs;
+            c->origin = o;
+            return take_x10out(o);
+        }
+        /* Used up its quantum, go to the back of the line */
+        o->inturn = 0;
+        if (o->next) {
+            active_unlink(lane, prev, o);
+            lane->activetail->next = o;
+            lane->activetail = o;
+            o = (prev) ? prev->next : lane->active;
+        }
+    }
+    return OUT_NONE;
+}
+
+/* Pick the next frame for c. The rest of the command being sent comes
+ * first, then setup frames for c, then the next command from the lane
+ * chosen by LanePolicy.
+ */
+static int next_frame(ctlrtx_t *c)
+{
+    origin_t *o = c->origin;
+    lane_t *lane, *other;
+    int idx;
+
+    if (o && (o->head != OUT_NONE) && !(Outrecs[o->head].flags & OUT_FIRST))
+        return take_x10out(o);
+    if (o) o->sending = 0;
+    c->origin = NULL;
+    if (c->setuphead != OUT_NONE) {
+        idx = c->setuphead;
+        c->setuphead = Outrecs[idx].next;
+        if (c->setuphead == OUT_NONE) c->setuptail = OUT_NONE;
+        Outrecs[idx].next = OUT_NONE;
+        return idx;
+    }
+    lane = lane_pick(c);
+    if (lane == NULL) return OUT_NONE;
+    idx = lane_next(c, lane);
+    if (idx != OUT_NONE) return idx;
+    /* Everything in that lane is being sent by another controller */
+    other = (lane == &Lanes[LANE_RF]) ? &Lanes[LANE_PL] : &Lanes[LANE_RF];
+    if ((other == &Lanes[LANE_PL]) && (c != Plctlr)) return OUT_NONE;
+    if (other->nframes == 0) return OUT_NONE;
+    return lane_next(c, other);
+}
+
+/* Upper edge of the bucket holding the pth percentile, ACK_MAX_MS if it
+ * is past the end
+ */
+static int ack_percentile(const ackhist_t *h, int p)
+{
+    unsigned long want, seen = 0;
+    int i;
+
+    if (h->samples == 0) return 0;
+    want = (h->samples * p + 99) / 100;
+    for (i = 0; i < ACK_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= want) return (i + 1) * ACK_BUCKET_MS;
+    }
+    return ACK_MAX_MS;
+}
+
+/* Count one ACK after latms, or a timeout if latms < 0, and recompute the
+ * timeout for h: the p99 latency plus ACK_MARGIN_MS, never more than
+ * ACK_MAX_MS. Timeouts count past the end of the histogram so the timeout
+ * goes back up if more than 1% of frames time out.
+ */
+static void ack_sample(ackhist_t *h, int latms)
+{
+    int i, ms;
+
+    if (latms < 0) {
+        h->count[ACK_BUCKETS]++;
+        h->timeouts++;
     }
     else {
-        Outbusy = 1;
-        PollTimeOut = 2*1000;   /* 2 seconds */
-        write_usb(buf, buflen);
+        i = latms / ACK_BUCKET_MS;
+        if (i >= ACK_BUCKETS) i = ACK_BUCKETS - 1;
+        h->count[i]++;
+        h->acked++;
+    }
+    if (++h->samples >= ACK_WINDOW) {
+        /* Forget old samples slowly so the timeout follows the device */
+        h->samples = 0;
+        for (i = 0; i <= ACK_BUCKETS; i++) {
+            h->count[i] /= 2;
+            h->samples += h->count[i];
+        }
+    }
+    if ((h->samples < ACK_MINSAMPLES) || (h->acked == 0)) {
+        h->timeoutms = ACK_MAX_MS;
+        return;
     }
+    ms = ack_percentile(h, 99) + ACK_MARGIN_MS;
+    if (ms < ACK_MIN_MS) ms = ACK_MIN_MS;
+    if (ms > ACK_MAX_MS) ms = ACK_MAX_MS;
+    h->timeoutms = ms;
+}
+
+/* Estimated time to send rec and get its ACK. The p50 ACK latency once a
+ * controller has learned it, else the nominal airtime. DIM and BRIGHT
+ * steps are added either way, most ACK samples are single step frames.
+ */
+static int frame_ms(const x10out_t *rec)
+{
+    static const int nominal[ACK_CLASSES] = {
+        PL_FRAME_MS, PLX_FRAME_MS, RF_FRAME_MS, RF_FRAME_MS
+    };
+    const ackhist_t *h;
+    int i, p50, ms = 0, dims = 0;
+
+    for (i = 0; i < CTLR_MAX; i++) {
+        h = &Ctlrs[i].acks[rec->ackclass];
+        if (!Ctlrs[i].present || (h->acked < ACK_MINSAMPLES)) continue;
+        p50 = ack_percentile(h, 50);
+        if (p50 > ms) ms = p50;
+    }
+    if (ms == 0) ms = nominal[rec->ackclass];
+    /* 06 <house|func> <dims << 3 | 06>, see pl_tx_housefunc() */
+    if ((rec->ackclass == ACK_PL) && (rec->outlen == 3) &&
+            (rec->outdata[0] == 0x06))
+        dims = rec->outdata[2] >> 3;
+    return ms + (dims * PL_DIMSTEP_MS);
+}
+
+/* Kind of frame for ACK timing. lane is where x10_write() put it. */
+static int ack_class(const unsigned char *buf, size_t buflen, int lane)
+{
+    unsigned char type;
+
+    if (lane == LANE_PL) return (buf[0] == 0x07) ? ACK_PLX : ACK_PL;
+    /* RF frames start with 0xEB, then the RF frame type */
+    if (buf[0] == 0xEB)
+        type = (buflen > 1) ? buf[1] : 0;
+    else
+        type = buf[0];
+    return (type == 0x20) ? ACK_RF : ACK_RFX;
+}
+
+/* Next USB write number, never 0 */
+static uint32_t seq_next(uint32_t *seq)
+{
+    if (++*seq == 0) ++*seq;
+    return *seq;
+}
+
+/* Write one frame to controller c and wait for its ACK, or with a window
+ * for its USB OUT transfer. A CM19A never sends an ACK so it may have up
+ * to RfWindow (--rf-window) frames in flight, each done when the CM19A
+ * has taken it. The ACK deadline runs from now, later traffic does not
+ * push it back.
+ */
+static void send_x10out(ctlrtx_t *c, int idx)
+{
+    x10out_t *rec = &Outrecs[idx];
+    lane_t *lane = &Lanes[rec->lane];
+    inflight_t *f = flight(c, c->nflight);
+    uint64_t waitus;
+    int rc;
+
+    f->idx = idx;
+    f->origin = c->origin;
+    f->sentus = monotonic_us();
+    f->deadline = f->sentus +
+        (uint64_t)c->acks[rec->ackclass].timeoutms * 1000;
+    f->windowed = (c->window > 1);
+    if (f->origin) f->origin->inflight++;
+    c->nflight++;
+    c->frames++;
+    lane->frames++;
+    if (rec->flags & OUT_FIRST) {
+        c->sentus = f->sentus;
+        rec->sentus = f->sentus;
+        waitus = c->sentus - rec->queuedus;
+        lane->waits++;
+        lane->waitus += waitus;
+        if (waitus > lane->maxwaitus) lane->maxwaitus = waitus;
+        cmd_notify(rec, CMD_SENT, c->sentus);
+    }
+    else if (rec->flags & OUT_JOINED) {
+        rec->sentus = f->sentus;
+        cmd_notify(rec, CMD_SENT, rec->sentus);
+    }
+    else {
+        rec->sentus = c->sentus;
+    }
+    /* So the other controllers hearing it do not report it as received.
+     * With only one there is nobody else to hear it, and a remote sending
+     * the same code just after is not an echo.
+     */
+    if ((Nctlrs > 1) && (rec->outdata[0] == 0xEB) && (rec->outlen > 1))
+        rfmerge_tx(rec->outdata + 1, rec->outlen - 1);
+    /* The CM19A RF frame is the CM15A one without the 0xEB */
+    if (c->cm19a && (rec->outdata[0] == 0xEB) && (rec->outlen > 1))
+        rc = write_usb(c - Ctlrs, rec->outdata + 1, rec->outlen - 1);
+    else
+        rc = write_usb(c - Ctlrs, rec->outdata, rec->outlen);
+    /* Each frame written gets one OUT transfer result, in order */
+    f->seq = (rc < 0) ? 0 : seq_next(&c->txseq);
+}
+
+/* Give every controller with room in its window something to send, the
+ * least used first, so RF frames go to the idle controller that has sent
+ * the fewest
+ */
+static void dispatch(void)
+{
+    ctlrtx_t *c, *best;
+    int i, idx, tried[CTLR_MAX];
+
+    memset(tried, 0, sizeof(tried));
+    for (;;) {
+        best = NULL;
+        for (i = 0; i < CTLR_MAX; i++) {
+            c = &Ctlrs[i];
+            if (!c->present || (c->nflight >= c->window) || tried[i])
+                continue;
+            if ((best == NULL) || (c->frames < best->frames)) best = c;
+        }
+        if (best == NULL) return;
+        idx = next_frame(best);
+        dbprintf("controller %d next frame %d, %d free\n",
+                (int)(best - Ctlrs), idx, Nfree);
+        if (idx != OUT_NONE)
+            send_x10out(best, idx);
+        else
+            tried[best - Ctlrs] = 1;
+    }
+}
+
+/* The oldest frame c has in flight is done, acked or not. Frames are done
+ * in the order they were written so the command they belong to is known
+ * from the ones done before.
+ */
+static void frame_done(ctlrtx_t *c, int acked)
+{
+    inflight_t *f = flight(c, 0);
+    x10out_t *rec = &Outrecs[f->idx];
+    ackhist_t *h = &c->acks[rec->ackclass];
+
+    if (rec->flags & OUT_FIRST) {
+        c->cmd = *rec;
+        c->failed = 0;
+        c->njoined = 0;
+    }
+    if (acked) {
+        Lanes[rec->lane].acked++;
+        ack_sample(h, (int)((monotonic_us() - f->sentus) / 1000));
+    }
+    else {
+        Lanes[rec->lane].timeouts++;
+        ack_sample(h, -1);
+        if (rec->cmdid && !c->failed &&
+                ((rec->cmdid == c->cmd.cmdid) || (rec->flags & OUT_JOINED))) {
+            c->failed = 1;
+            cmd_notify(&c->cmd, CMD_TIMEOUT, c->cmd.sentus);
+        }
+    }
+    if ((rec->flags & OUT_JOINED) && (c->njoined < JOIN_MAX))
+        c->joined[c->njoined++] = *rec;
+    if (rec->flags & OUT_LAST) {
+        if (acked && (rec->cmdid == c->cmd.cmdid) && !c->failed)
+            cmd_notify(rec, CMD_ACKED, rec->sentus);
+        joined_done(c);
+    }
+    if (f->origin) f->origin->inflight--;
+    free_x10out(f->idx);
+    c->flhead = (c->flhead + 1) % RFWINDOW_MAX;
+    c->nflight--;
+    dispatch();
+}
+
+/* c is not keeping up with its window, go back to stop-and-wait. It opens
+ * again after RFWINDOW_PROBE frames in a row are taken in time.
+ */
+static void window_close(ctlrtx_t *c)
+{
+    if (c->window <= 1) return;
+    c->window = 1;
+    c->probe = 0;
+    c->fallbacks++;
+    syslog(LOG_WARNING, "controller %d is not keeping up, RF window closed",
+            (int)(c - Ctlrs));
+}
+
+/* Controller ctlr acknowledged its frame in flight. The first ACK after
+ * a timeout is usually the late one for the frame that timed out. If it
+ * comes within ACK_MARGIN_MS of the timeout, or in under half the p50
+ * latency of the frame now in flight, it is ignored, else that frame
+ * would be taken as done while the CM15A is still sending it.
+ */
+int x10_ack(int ctlr)
+{
+    ctlrtx_t *c;
+    inflight_t *f;
+    uint64_t now = monotonic_us(), timedoutus;
+    int p50;
+
+    if ((ctlr < 0) || (ctlr >= CTLR_MAX)) return 0;
+    c = &Ctlrs[ctlr];
+    timedoutus = c->timedoutus;
+    c->timedoutus = 0;
+    /* Windowed frames are done by their USB OUT transfer */
+    if ((c->nflight == 0) || flight(c, 0)->windowed) return 0;
+    f = flight(c, 0);
+    if (timedoutus) {
+        p50 = ack_percentile(&c->acks[Outrecs[f->idx].ackclass], 50);
+        if ((now - timedoutus < (uint64_t)ACK_MARGIN_MS * 1000) ||
+                ((now - f->sentus) < (uint64_t)p50 * 500)) {
+            dbprintf("controller %d late ACK ignored\n", ctlr);
+            return 0;
+        }
+    }
+    frame_done(c, 1);
+    return 0;
+}
+
+/* The USB OUT transfer of the next frame written to controller ctlr
+ * finished, ok 0 if it failed. That is the ACK for a windowed frame. For
+ * a frame sent stop-and-wait after the window closed, it shows whether the
+ * CM19A is keeping up again. Results come in the order the frames were
+ * written, so the frame is known by counting. A frame that already timed
+ * out is not in flight any more and its result is ignored.
+ */
+int x10_sent(int ctlr, int ok)
+{
+    ctlrtx_t *c;
+    inflight_t *f;
+    uint32_t seq;
+
+    if ((ctlr < 0) || (ctlr >= CTLR_MAX)) return 0;
+    c = &Ctlrs[ctlr];
+    seq = seq_next(&c->doneseq);
+    /* Windowed frames that never made it to USB will not finish */
+    while (c->nflight && flight(c, 0)->windowed && !flight(c, 0)->seq) {
+        window_close(c);
+        frame_done(c, 0);
+    }
+    if (c->nflight == 0) return 0;
+    f = flight(c, 0);
+    if (f->seq != seq) return 0;
+    if (f->windowed) {
+        if (!ok) window_close(c);
+        frame_done(c, ok);
+        return 0;
+    }
+    if (!c->cm19a || (RfWindow <= 1) || (c->window > 1)) return 0;
+    if (!ok || (monotonic_us() >= f->deadline)) {
+        c->probe = 0;
+    }
+    else if (++c->probe >= RFWINDOW_PROBE) {
+        c->window = RfWindow;
+        syslog(LOG_INFO, "controller %d RF window open, %d frames", ctlr,
+                c->window);
+    }
+    return 0;
+}
+
+/* Milliseconds until the first frame in flight times out, -1 if none. For
+ * the reactor timeout.
+ */
+int x10_poll_timeout(void)
+{
+    uint64_t now = 0, deadline = 0;
+    inflight_t *f;
+    int i;
+
+    for (i = 0; i < CTLR_MAX; i++) {
+        if (Ctlrs[i].nflight == 0) continue;
+        f = flight(&Ctlrs[i], 0);
+        if ((deadline == 0) || (f->deadline < deadline))
+            deadline = f->deadline;
+    }
+    if (deadline == 0) return -1;
+    now = monotonic_us();
+    if (now >= deadline) return 0;
+    return (int)((deadline - now + 999) / 1000);
+}
+
+/* Give up on frames in flight that are past their deadline and send the
+ * next. A windowed frame that times out means the controller is not
+ * keeping up.
+ */
+int x10_timeout(void)
+{
+    ctlrtx_t *c;
+    inflight_t *f;
+    uint64_t now = monotonic_us();
+    int i;
+
+    for (i = 0; i < CTLR_MAX; i++) {
+        c = &Ctlrs[i];
+        while (c->nflight) {
+            f = flight(c, 0);
+            if (now < f->deadline) break;
+            if (f->windowed)
+                window_close(c);
+            else
+                c->timedoutus = now;
+            frame_done(c, 0);
+        }
+    }
+    return 0;
+}
+
+/* Controller ctlr is open. cm19a if it can only do RF. The first CM15A
+ * sends all PL frames.
+ */
+void x10_ctlr_add(int ctlr, int cm19a)
+{
+    ctlrtx_t *c;
+    int i;
+
+    if ((ctlr < 0) || (ctlr >= CTLR_MAX)) return;
+    outrecs_init();
+    if (RfWindow < 1) RfWindow = 1;
+    if (RfWindow > RFWINDOW_MAX) RfWindow = RFWINDOW_MAX;
+    c = &Ctlrs[ctlr];
+    if (!c->present) Nctlrs++;
+    memset(c, 0, sizeof(*c));
+    c->present = 1;
+    c->cm19a = cm19a;
+    c->window = (cm19a && (RfWindow > 1)) ? RfWindow : 1;
+    c->setuphead = c->setuptail = OUT_NONE;
+    for (i = 0; i < ACK_CLASSES; i++) {
+        c->acks[i].name = Ackname[i];
+        c->acks[i].timeoutms = ACK_MAX_MS;
+    }
+    if (!cm19a && (Plctlr == NULL)) Plctlr = c;
+}
+
+/* Frames written until x10_cmd_end() are command cmdid from client fd.
+ * etams is the estimated wait before it is sent, see x10_eta().
+ */
+void x10_cmd_begin(uint32_t cmdid, int fd, uint32_t serial, int etams)
+{
+    memset(&Newcmd, 0, sizeof(Newcmd));
+    Newcmd.cmdid = cmdid;
+    Newcmd.fd = fd;
+    Newcmd.serial = serial;
+    Newcmd.queuedus = monotonic_us();
+    Newcmd.flags = OUT_FIRST;
+    Lastout = OUT_NONE;
+    Newfirst = OUT_NONE;
+    Neworigin = NULL;
+    Newdropped = 0;
+    Incmd = 1;
+    if ((cmdid != 0) && (fd >= 0))
+        client_cmd_notify(fd, serial, cmdid, CMD_QUEUED,
+                (uint64_t)etams * 1000, 0);
+}
+
+void x10_cmd_end(void)
+{
+    /* If the last frame was sent right away this marks the frame in
+     * flight. Its ACK cannot have arrived yet.
+     */
+    if (Lastout != OUT_NONE) Outrecs[Lastout].flags |= OUT_LAST;
+    if (Newcmd.plop && (Newfirst != OUT_NONE) && !in_flight(Newfirst) &&
+            !coalesce(Neworigin, Newfirst))
+        join(Neworigin, Newfirst);
+    Newfirst = OUT_NONE;
+    Neworigin = NULL;
+    memset(&Newcmd, 0, sizeof(Newcmd));
+    Newcmd.fd = -1;
+    Lastout = OUT_NONE;
+    Newdropped = 0;
+    Incmd = 0;
+}
+
+/* The command being queued is for house, and unit or -1 for all of it */
+void x10_cmd_addr(int house, int unit)
+{
+    Newcmd.addressed = 1;
+    Newcmd.house = house;
+    Newcmd.unit = (unit < 0) ? 0xFF : unit;
+}
+
+/* The command being queued is dropped if it has not started ttlms from
+ * now, 0 for no limit. A command batched into another keeps that one
+ * alive until the later of their deadlines.
+ */
+void x10_cmd_ttl(uint32_t ttlms)
+{
+    Newcmd.deadline = (ttlms) ?
+        Newcmd.queuedus + (uint64_t)ttlms * 1000 : 0;
+}
+
+/* The command being queued is a PL unit command doing op. dims is the
+ * DIM/BRIGHT step.
+ */
+void x10_cmd_pl(int house, int unit, plop_t op, int dims)
+{
+    x10_cmd_addr(house, unit);
+    Newcmd.plop = op;
+    Newcmd.dims = dims;
+}
+
+/* Most frames client fd has waiting in either lane */
+int x10_write_queued(int fd)
+{
+    client_t *client = client_find(fd);
+    origin_t *o;
+    int lane, used = 0;
+
+    outrecs_init();
+    for (lane = 0; lane < LANE_MAX; lane++) {
+        if (client)
+            o = origin_find(fd, client->serial, lane, 0);
+        else
+            o = &Lanes[lane].self;
+        if (o && (o->nframes > used)) used = o->nframes;
+    }
+    return used;
+}
+
+/* Number of frames client fd can write to either lane without any being
+ * dropped
+ */
+int x10_write_room(int fd)
+{
+    int room;
+
+    room = Quota - x10_write_queued(fd);
+    if (room > (Nfree + TxQueueMax - Outsize))
+        room = Nfree + TxQueueMax - Outsize;
+    return room;
+}
+
+/* Estimated ms before a command on the RF lane if rf, else the PL lane,
+ * is sent with ahead ms of frames in front of it. RF frames are spread
+ * over all the controllers. PL frames all go to the first CM15A, which
+ * also sends the RF frames when it is the only controller.
+ */
+static int eta_after(int rf, long ahead)
+{
+    ctlrtx_t *c;
+    uint64_t now = monotonic_us();
+    long left, plleft = 0, rfleft = 0, ms;
+    int i, k, n = 0;
+
+    for (i = 0; i < CTLR_MAX; i++) {
+        c = &Ctlrs[i];
+        if (!c->present) continue;
+        n++;
+        if (c->nflight == 0) continue;
+        /* What is left of the frames in flight */
+        left = 0;
+        for (k = 0; k < c->nflight; k++)
+            left += Outrecs[flight(c, k)->idx].airms;
+        left -= (long)((now - flight(c, 0)->sentus) / 1000);
+        if (left < 0) left = 0;
+        if (c == Plctlr) plleft = left;
+        rfleft += left;
+    }
+    if (n == 0) n = 1;
+    /* With no CM15A, PL commands are sent as RF */
+    if (rf || (Plctlr == NULL))
+        ms = (ahead + rfleft) / n;
+    else {
+        ms = ahead + plleft;
+        if (n == 1) ms += Lanes[LANE_RF].airms;
+    }
+    return (int)ms;
+}
+
+/* Estimated ms before a command queued now on the RF lane if rf, else the
+ * PL lane, is sent. Everything already waiting in its lane goes first.
+ */
+int x10_eta(int rf)
+{
+    return eta_after(rf, Lanes[(rf) ? LANE_RF : LANE_PL].airms);
+}
+
+/* Can plframes PL and rfframes RF frames from client fd be queued now.
+ * *etams is the estimated wait before the first of them is sent. Returns
+ * ADMIT_OK, ADMIT_FULL if some would be dropped, or ADMIT_BUSY if the wait
+ * is over MaxLatency, rather than send it long after it was wanted.
+ * mochad's own frames are not held to MaxLatency.
+ */
+int x10_admit(int fd, int plframes, int rfframes, int *etams)
+{
+    int frames[LANE_MAX], eta[LANE_MAX], i, rc = ADMIT_OK;
+
+    outrecs_init();
+    frames[LANE_PL] = plframes;
+    frames[LANE_RF] = rfframes;
+    *etams = 0;
+    for (i = 0; i < LANE_MAX; i++) {
+        eta[i] = (frames[i]) ? x10_eta(i == LANE_RF) : 0;
+        if (eta[i] > *etams) *etams = eta[i];
+    }
+    /* Room is made for new commands when dropping the oldest */
+    if ((TxOverflow != OVERFLOW_DROPOLDEST) &&
+            ((plframes + rfframes) > x10_write_room(fd)))
+        return ADMIT_FULL;
+    if ((MaxLatency <= 0) || (fd < 0)) return ADMIT_OK;
+    for (i = 0; i < LANE_MAX; i++) {
+        if (eta[i] > MaxLatency) {
+            Lanes[i].rejected++;
+            rc = ADMIT_BUSY;
+        }
+    }
+    return rc;
+}
+
+/* Frames of one command, or the rest of one being sent, added to buf
+ * for QUEUE LIST. Batched commands are shown by id after their address.
+ */
+static void cmd_frames(char *buf, size_t size, int idx, long *ms, int *next)
+{
+    x10out_t *rec;
+    size_t len = strlen(buf);
+    int i;
+
+    *ms = 0;
+    do {
+        rec = &Outrecs[idx];
+        *ms += rec->airms;
+        for (i = 0; (i < rec->outlen) && (len < size); i++)
+            len += snprintf(buf + len, size - len, "%s%02X",
+                    (i) ? " " : (len) ? ", " : " ", rec->outdata[i]);
+        if ((rec->flags & OUT_JOINED) && (len < size))
+            len += snprintf(buf + len, size - len, " (%u)", rec->cmdid);
+        idx = rec->next;
+    } while (!(rec->flags & OUT_LAST) && (idx != OUT_NONE) &&
+            !(Outrecs[idx].flags & OUT_FIRST));
+    *next = idx;
+}
+
+/* QUEUE LIST. Frames in flight, then the commands waiting in each lane in
+ * about the order they will go out: one command per origin per round, as
+ * DRR does. fd -1 is mochad itself.
+ */
+void x10_queue_list(int fd)
+{
+    origin_t *o;
+    int cursor[ORIGIN_MAX + 1];
+    char frames[512];
+    lane_t *lane;
+    ctlrtx_t *c;
+    x10out_t *rec;
+    uint64_t now = monotonic_us();
+    long ms, ahead;
+    int i, k, l, n, idx, more, ncmds = 0;
+
+    outrecs_init();
+    for (i = 0; i < CTLR_MAX; i++) {
+        c = &Ctlrs[i];
+        for (k = 0; k < c->nflight; k++) {
+            idx = flight(c, k)->idx;
+            rec = &Outrecs[idx];
+            frames[0] = '\0';
+            cmd_frames(frames, sizeof(frames), idx, &ms, &idx);
+            /* The newest frame in flight is followed by the rest of its
+             * command, still waiting in its origin
+             */
+            o = c->origin;
+            if ((k == c->nflight - 1) && !(rec->flags & OUT_LAST) && o &&
+                    (o->head != OUT_NONE) &&
+                    !(Outrecs[o->head].flags & OUT_FIRST))
+                cmd_frames(frames, sizeof(frames), o->head, &ms, &idx);
+            sockprintf(fd, "Sending %u %s fd %d age %lu ms controller "
+                    "%d:%s\n", rec->cmdid, Lanes[rec->lane].name, rec->fd,
+                    (unsigned long)((now - rec->queuedus) / 1000), i,
+                    frames);
+        }
+    }
+    for (l = 0; l < LANE_MAX; l++) {
+        lane = &Lanes[l];
+        n = 0;
+        for (o = lane->active; o && (n <= ORIGIN_MAX); o = o->next)
+            cursor[n++] = o->head;
+        ahead = 0;
+        do {
+            more = 0;
+            for (i = 0; i < n; i++) {
+                idx = cursor[i];
+                if (idx == OUT_NONE) continue;
+                rec = &Outrecs[idx];
+                frames[0] = '\0';
+                cmd_frames(frames, sizeof(frames), idx, &ms, &cursor[i]);
+                if (cursor[i] != OUT_NONE) more = 1;
+                /* The rest of a command being sent goes first */
+                if (rec->flags & OUT_FIRST) {
+                    sockprintf(fd, "Queue %u %s fd %d age %lu ms eta %d "
+                            "ms:%s\n", rec->cmdid, lane->name, rec->fd,
+                            (unsigned long)((now - rec->queuedus) / 1000),
+                            eta_after(l == LANE_RF, ahead), frames);
+                    ncmds++;
+                }
+                ahead += ms;
+            }
+        } while (more);
+    }
+    sockprintf(fd, "Queue %d commands\n", ncmds);
+}
+
+/* Does waiting command rec match QUEUE CANCEL by, arg, unit. For
+ * CANCEL_FD, client is the connection now on fd arg, if any, so commands
+ * from an earlier connection that had the same fd are left alone.
+ */
+static int cancel_match(const x10out_t *rec, cancelby_t by, long arg,
+        int unit, const client_t *client)
+{
+    if (rec->cmdid == 0) return 0;
+    switch (by) {
+        case CANCEL_ID:
+            return (rec->cmdid == (uint32_t)arg);
+        case CANCEL_FD:
+            return (rec->fd == arg) &&
+                ((client == NULL) || (rec->serial == client->serial));
+        case CANCEL_UNIT:
+            return rec->addressed && (rec->house == arg) &&
+                ((unit < 0) || (rec->unit == unit));
+    }
+    return 0;
+}
+
+/* QUEUE CANCEL. Remove the waiting commands with id arg, from client fd
+ * arg, or for house arg and unit, or all of house arg if unit is -1.
+ * Returns the number removed.
+ */
+int x10_cancel(cancelby_t by, long arg, int unit)
+{
+    client_t *client = (by == CANCEL_FD) ? client_find(arg) : NULL;
+    origin_t *o;
+    x10out_t *rec;
+    int i, l, idx, found, n = 0;
+
+    outrecs_init();
+    do {
+        found = 0;
+        for (l = 0; (l < LANE_MAX) && !found; l++) {
+            for (i = -1; (i < ORIGIN_MAX) && !found; i++) {
+                o = (i < 0) ? &Lanes[l].self : &Origins[i];
+                if ((o->nframes == 0) || (o->lane != l)) continue;
+                /* Skip the rest of a command a controller has started */
+                for (idx = o->head; (idx != OUT_NONE) &&
+                        !(Outrecs[idx].flags & OUT_FIRST);
+                        idx = Outrecs[idx].next)
+                    ;
+                for (; idx != OUT_NONE; idx = rec->next) {
+                    rec = &Outrecs[idx];
+                    if ((rec->flags & (OUT_FIRST|OUT_JOINED)) &&
+                            cancel_match(rec, by, arg, unit, client)) {
+                        cancel_cmd(o, idx);
+                        found = 1;
+                        n++;
+                        break;
+                    }
+                }
+            }
+        }
+    } while (found);
+    return n;
+}
+
+/* Report per lane queue depth, counters, and wait times, and per
+ * controller frames and ACK latency
+ */
+void x10_stats(int fd)
+{
+    lane_t *lane;
+    ctlrtx_t *c;
+    ackhist_t *h;
+    int i, j;
+
+    for (i = 0; i < LANE_MAX; i++) {
+        lane = &Lanes[i];
+        sockprintf(fd, "Lane %s depth %d frames %lu acked %lu timeouts %lu "
+                "dropped %lu commands %lu frames expired %lu commands %lu "
+                "frames cancelled %lu wait avg %lu ms max %lu ms eta %d ms "
+                "rejected %lu\n",
+                lane->name, lane->nframes, lane->frames, lane->acked,
+                lane->timeouts, lane->droppedcmds, lane->dropped,
+                lane->expired,
+                lane->expiredframes, lane->cancelled,
+                (unsigned long)((lane->waits) ?
+                    lane->waitus / lane->waits / 1000 : 0),
+                (unsigned long)(lane->maxwaitus / 1000),
+                x10_eta(i == LANE_RF), lane->rejected);
+    }
+    sockprintf(fd, "Queue frames %d free %d max %d per origin %d "
+            "overflow %s\n", Outsize, Nfree, TxQueueMax, Quota,
+            Overflowname[TxOverflow]);
+    lane = &Lanes[LANE_PL];
+    sockprintf(fd, "Coalesced %lu commands %lu frames, batched %lu "
+            "commands, %lu ms of PL airtime saved\n", lane->coalesced,
+            lane->framesaved, lane->batched,
+            (lane->framesaved + lane->batched) * PL_FRAME_MS);
+    for (i = 0; i < CTLR_MAX; i++) {
+        c = &Ctlrs[i];
+        if (!c->present) continue;
+        sockprintf(fd, "Controller %d %s sends %s frames %lu window %d of %d "
+                "fallbacks %lu\n", i, (c->cm19a) ? "CM19A" : "CM15A",
+                (c == Plctlr) ? "PL RF" : "RF", c->frames, c->window,
+                (c->cm19a) ? RfWindow : 1, c->fallbacks);
+        for (j = 0; j < ACK_CLASSES; j++) {
+            h = &c->acks[j];
+            if ((h->acked == 0) && (h->timeouts == 0)) continue;
+            sockprintf(fd, "Ack %d %s acked %lu timeouts %lu p50 %d ms "
+                    "p90 %d ms p99 %d ms timeout %d ms\n", i, h->name,
+                    h->acked, h->timeouts, ack_percentile(h, 50),
+                    ack_percentile(h, 90), ack_percentile(h, 99),
+                    h->timeoutms);
+        }
+    }
+}
+
+int x10_write(unsigned char *buf, size_t buflen)
+{
+    origin_t *o;
+    int lane;
+
+    dbprintf("len %lu\n", (unsigned long)buflen);
+    outrecs_init();
+    /* A frame on its own is a command of one frame */
+    if (!Incmd) {
+        Newcmd.fd = -1;
+        Newcmd.flags = OUT_FIRST|OUT_LAST;
+        Newcmd.queuedus = monotonic_us();
+    }
+    /* The RF transmit frame starts with 0xEB. With only CM19As everything
+     * is RF.
+     */
+    lane = (Cm19a || (buf[0] == 0xEB)) ? LANE_RF : LANE_PL;
+    Newcmd.ackclass = ack_class(buf, buflen, lane);
+    o = origin_find((Newcmd.cmdid) ? Newcmd.fd : -1, Newcmd.serial, lane, 1);
+    if (Newdropped) {
+        Lanes[lane].dropped++;
+        return 0;
+    }
+    if (add_x10out(o, buf, buflen) < 0) {
+        /* Do not send part of a command. Frames already sent stay sent. */
+        if (Incmd) {
+            Newdropped = 1;
+            if ((Newfirst != OUT_NONE) && !in_flight(Newfirst))
+                remove_cmd(Neworigin, Newfirst, CMD_DROPPED);
+            else {
+                Lanes[lane].droppedcmds++;
+                cmd_notify(&Newcmd, CMD_DROPPED, 0);
+            }
+            Newfirst = OUT_NONE;
+            Lastout = OUT_NONE;
+        }
+        return 0;
+    }
+    Newcmd.flags &= ~OUT_FIRST;
+    dispatch();
+    return buflen;
+}
+
+/* Queue a setup frame for controller ctlr only, ahead of other frames */
+int x10_write_ctlr(int ctlr, unsigned char *buf, size_t buflen)
+{
+    ctlrtx_t *c;
+    x10out_t *rec;
+    int idx;
+
+    outrecs_init();
+    if ((ctlr < 0) || (ctlr >= CTLR_MAX) || !Ctlrs[ctlr].present) return 0;
+    c = &Ctlrs[ctlr];
+    if (buflen > sizeof(rec->outdata)) return 0;
+    idx = alloc_x10out();
+    if (idx == OUT_NONE) return 0;
+    rec = &Outrecs[idx];
+    memset(rec, 0, sizeof(*rec));
+    rec->next = OUT_NONE;
+    rec->fd = -1;
+    rec->flags = OUT_FIRST|OUT_LAST;
+    rec->queuedus = monotonic_us();
+    rec->lane = (c->cm19a || (buf[0] == 0xEB)) ? LANE_RF : LANE_PL;
+    rec->ackclass = ack_class(buf, buflen, rec->lane);
+    rec->outlen = buflen;
+    memcpy(rec->outdata, buf, buflen);
+    if (c->setuptail == OUT_NONE)
+        c->setuphead = idx;
+    else
+        Outrecs[c->setuptail].next = idx;
+    c->setuptail = idx;
+    dispatch();
     return buflen;
 }
@@ -17,7 +17,102 @@
  * along with mochad.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-int send_next_x10out(void);
+/* Command progress reported to the client that sent it */
+typedef enum cmdstate {
+    CMD_QUEUED = 0,
+    CMD_SENT,               /* First frame written to the controller */
+    CMD_ACKED,              /* Last frame acknowledged */
+    CMD_TIMEOUT,            /* A frame was not acknowledged in time */
+    CMD_COALESCED,          /* Made redundant by a later command, not sent */
+    CMD_EXPIRED,            /* Not started before its TTL ran out, not sent */
+    CMD_CANCELLED,          /* Removed by QUEUE CANCEL, not sent */
+    CMD_DROPPED,            /* Output queue full, not sent */
+} cmdstate_t;
+
+/* PL unit commands that can be coalesced in the output queue */
+typedef enum plop {
+    PLOP_ON = 1,
+    PLOP_OFF,
+    PLOP_DIM,
+    PLOP_BRIGHT,
+    PLOP_XDIM
+} plop_t;
+
+/* How the next command is chosen when both RF and PL are waiting */
+typedef enum lanepolicy {
+    LANE_RFFIRST = 0,       /* RF whenever RF is waiting */
+    LANE_ROUNDROBIN         /* One command from each lane in turn */
+} lanepolicy_t;
+
+/* What to do when a frame does not fit in the output queue */
+typedef enum overflow {
+    OVERFLOW_REJECT = 0,    /* Drop the new command */
+    OVERFLOW_DROPOLDEST,    /* Drop the oldest waiting command instead */
+    OVERFLOW_BLOCK          /* Stop reading from connections until there is
+                               room, see client_hold() */
+} overflow_t;
+
+/* What QUEUE CANCEL removes */
+typedef enum cancelby {
+    CANCEL_ID = 0,          /* One command */
+    CANCEL_FD,              /* Everything from one connection */
+    CANCEL_UNIT             /* Everything for a house, or house and unit */
+} cancelby_t;
+
+/* x10_admit() return */
+#define ADMIT_OK        (0)
+#define ADMIT_FULL      (-1)    /* Not enough room in the output queue */
+#define ADMIT_BUSY      (-2)    /* Estimated wait is over MaxLatency */
+
+extern lanepolicy_t LanePolicy;
+
+/* Longest estimated wait in ms a client command is queued for, 0 for no
+ * limit
+ */
+extern int MaxLatency;
+
+/* RF frames a CM19A may have in flight, 1 for stop-and-wait */
+#define RFWINDOW_MAX    (8)
+extern int RfWindow;
+
+/* Most frames in the output queue, and what to do when it is full */
+extern int TxQueueMax;
+extern overflow_t TxOverflow;
+
+void x10_cmd_begin(uint32_t cmdid, int fd, uint32_t serial, int etams);
+
+void x10_cmd_end(void);
+
+void x10_cmd_addr(int house, int unit);
+
+void x10_cmd_ttl(uint32_t ttlms);
+
+void x10_cmd_pl(int house, int unit, plop_t op, int dims);
+
+int x10_ack(int ctlr);
+
+int x10_sent(int ctlr, int ok);
+
+int x10_timeout(void);
+
+int x10_poll_timeout(void);
 
 int x10_write(unsigned char *buf, size_t buflen);
 
+int x10_write_ctlr(int ctlr, unsigned char *buf, size_t buflen);
+
+void x10_ctlr_add(int ctlr, int cm19a);
+
+int x10_write_queued(int fd);
+
+int x10_write_room(int fd);
+
+int x10_eta(int rf);
+
+int x10_admit(int fd, int plframes, int rfframes, int *etams);
+
+void x10_queue_list(int fd);
+
+int x10_cancel(cancelby_t by, long arg, int unit);
+
+void x10_stats(int fd);
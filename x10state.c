@@ -56,6 +56,11 @@ static houseunitaddrs_t HouseUnitDim;
  * 0 = house/unit code, 1 = house/function */
 static int X10protostate[16];
 
+/* Bumped whenever HouseUnitState, HouseUnitDim, or X10sensors change so
+ * renderings of the state can be cached.
+ */
+static unsigned long HuaVersion = 0;
+
 /* HouseUnitSelect and X10protostate are needed because of the following case.
  * pl b3    # Select b3
  * pl b4    # Select b4
@@ -71,6 +76,7 @@ void hua_sec_init(void)
 
     memset(X10sensors, 0, sizeof(X10sensors));
     X10sensorcount = 0;
+    HuaVersion++;
 }
 
 #define issecfunc(x) (((x & 0xF0) == 0x80) || ((x & 0xF0) == 0x00))
@@ -84,6 +90,7 @@ void hua_sec_event(unsigned char *secaddr, unsigned int funcint,
     x10secsensor_t *sen;
 
     secaddr32 = (secaddr[0] << 16) | (secaddr[1] << 8) | secaddr[2] ;
+    HuaVersion++;
     /* dbprintf("secaddr32 %X func %X issecfunc %d\n", 
             secaddr32, funcint, issecfunc(funcint)); */
 
@@ -160,6 +167,7 @@ void hua_setstatus_xdim(int house, int unit, int xdim)
     HouseUnitSelected[house][unit] = '1';
     X10protostate[house] = 1;
     HouseUnitDim[house][unit] = xdim;
+    HuaVersion++;
     if (xdim > 0)
         HouseUnitState[house][unit] = '1';
     else
@@ -188,6 +196,7 @@ static void hua_func_all(int house, unsigned char func)
     int u;
 
     X10protostate[house] = 1;
+    HuaVersion++;
     for (u = 0; u < 16; u++) {
         HouseUnitState[house][u] = func;
         if (func == '1')
@@ -214,6 +223,7 @@ static void hua_func(int house, unsigned char func)
 
     /* dbprintf("%s(%d,%d)\n", __func__, house, func); */
     X10protostate[house] = 1;
+    HuaVersion++;
     for (u = 0; u < 16; u++) {
         if (HouseUnitSelected[house][u]) {
             HouseUnitState[house][u] = func;
@@ -357,3 +367,57 @@ void hua_show(int fd)
 
     sockprintf(fd, "End status\n");
 }
+
+/* Changes each time the device or sensor state changes */
+unsigned long hua_version(void)
+{
+    return HuaVersion;
+}
+
+/* Render device and security sensor state as JSON. Returns the length,
+ * which is more than buflen - 1 if buf was too small.
+ */
+size_t hua_json(char *buf, size_t buflen)
+{
+    int h, u;
+    int sensor;
+    size_t len = 0;
+    const char *sep = "";
+    x10secsensor_t *sen;
+
+#define JSON_APPEND(...) \
+    len += snprintf(buf + ((len < buflen) ? len : buflen), \
+            (len < buflen) ? buflen - len : 0, __VA_ARGS__)
+
+    JSON_APPEND("{\"devices\":[");
+    for (h = 0; h < 16; h++) {
+        for (u = 0; u < 16; u++) {
+            if (HouseUnitState[h][u] == 0) continue;
+            JSON_APPEND("%s{\"addr\":\"%c%d\",\"state\":\"%s\",\"dim\":%d}",
+                    sep, h+'A', u+1,
+                    (HouseUnitState[h][u] == '1') ? "on" : "off",
+                    HouseUnitDim[h][u]);
+            sep = ",";
+        }
+    }
+    JSON_APPEND("],\"sensors\":[");
+    sep = "";
+    for (sensor = 0; sensor < X10sensorcount; sensor++) {
+        const char *message;
+
+        sen = &X10sensors[sensor];
+        if (sen->secaddr8)
+            message = findSecRemoteKeyName(sen->sensorstatus);
+        else
+            message = findSecEventName(sen->sensorstatus);
+        JSON_APPEND("%s{\"addr\":\"%06lX\",\"addr8\":%s,\"func\":%d,"
+                "\"status\":\"%s\",\"updated\":%ld}",
+                sep, sen->secaddr, (sen->secaddr8) ? "true" : "false",
+                sen->sensorstatus, (message) ? message : "",
+                (long)sen->lastupdate);
+        sep = ",";
+    }
+    JSON_APPEND("]}\n");
+#undef JSON_APPEND
+    return len;
+}
@@ -39,3 +39,7 @@ unsigned char hua_getstatus_xdim(int house, int unit);
 void hua_setstatus_xdim(int house, int unit, int xdim);
 int hua_getstatus_sec(int rf8bitaddr, unsigned long rfaddr);
 
+unsigned long hua_version(void);
+
+size_t hua_json(char *buf, size_t buflen);
+